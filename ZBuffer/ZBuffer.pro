@@ -5,12 +5,29 @@ SOURCES += \
   src/GLWidget.cpp \
   src/ZBWidget.cpp \
   src/Model.cpp \
+  src/Renderer.cpp \
+  src/RasterSIMD.cpp \
+  src/DepthBuffer.cpp \
+  src/HiZBuffer.cpp \
+  src/ScanlineZBuffer.cpp \
+  src/ThreadPool.cpp \
+  src/FrameArena.cpp \
   src/main.cc
 
 HEADERS += \
   src/GLWidget.hpp \
   src/MainWindow.hpp \
-  src/ZBWidget.hpp
+  src/ZBWidget.hpp \
+  src/Renderer.hpp \
+  src/RasterSIMD.hpp \
+  src/DepthBuffer.hpp \
+  src/HiZBuffer.hpp \
+  src/ScanlineZBuffer.hpp \
+  src/RasterKernel.inl \
+  src/TransformKernel.inl \
+  src/AlignedArray.hpp \
+  src/ThreadPool.hpp \
+  src/FrameArena.hpp
 
 FORMS += \
   src/MainWindow.ui
@@ -34,7 +51,7 @@ MOC_DIR     = build/
 UI_DIR      = build/
 
 QT          += opengl xml widgets gui
-CONFIG      += debug
+CONFIG      += debug c++11 thread
 
 DESTDIR     = ..
 TARGET      = zbuffer
@@ -0,0 +1,76 @@
+#ifndef __ALIGNED_ARRAY_HPP__
+#define __ALIGNED_ARRAY_HPP__
+
+#include <algorithm>
+#include <stdint.h>
+
+/** \brief Array of plain values starting on an ALIGNMENT byte boundary,
+ * for aligned vector loads and stores.
+ */
+template <typename T>
+class AlignedArray {
+public:
+  static const size_t ALIGNMENT = 64;
+
+public:
+  AlignedArray()
+    : m_storage(0), m_data(0), m_size(0)
+  {}
+
+  AlignedArray(const AlignedArray &a)
+    : m_storage(0), m_data(0), m_size(0)
+  {
+    *this = a;
+  }
+
+  ~AlignedArray()
+  {
+    delete[] m_storage;
+  }
+
+  AlignedArray &operator=(const AlignedArray &a)
+  {
+    if ( this != &a )
+    {
+      resize(a.m_size);
+      std::copy(a.m_data, a.m_data + a.m_size, m_data);
+    }
+    return *this;
+  }
+
+  /** \brief Make room for n values; the contents are lost if n changes.
+   */
+  void resize(size_t n)
+  {
+    if ( n == m_size )
+      return;
+
+    delete[] m_storage;
+    m_storage = 0;
+    m_data = 0;
+    m_size = n;
+    if ( n == 0 )
+      return;
+
+    m_storage = new uint8_t[n * sizeof(T) + ALIGNMENT];
+    const uintptr_t base = reinterpret_cast<uintptr_t>(m_storage);
+    m_data = reinterpret_cast<T*>(m_storage + (ALIGNMENT - base % ALIGNMENT) % ALIGNMENT);
+  }
+
+  size_t size() const { return m_size; }
+  T *data() { return m_data; }
+  const T *data() const { return m_data; }
+  T &operator[](size_t i) { return m_data[i]; }
+  const T &operator[](size_t i) const { return m_data[i]; }
+
+private:
+  uint8_t *m_storage;
+  T *m_data;
+  size_t m_size;
+
+};
+
+template <typename T>
+const size_t AlignedArray<T>::ALIGNMENT;
+
+#endif //__ALIGNED_ARRAY_HPP__
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include "DepthBuffer.hpp"
+
+const size_t DepthBuffer::ALIGNMENT;
+const int DepthBuffer::BLOCK_SIZE;
+
+namespace {
+
+size_t bytesPerPixel(DepthBuffer::Format format)
+{
+  return format == DepthBuffer::FORMAT_UNORM16 ? 2 : 4;
+}
+
+}
+
+const char *DepthBuffer::formatName(Format format)
+{
+  switch ( format )
+  {
+    case FORMAT_FLOAT32:
+      return "float32";
+    case FORMAT_UNORM24:
+      return "unorm24";
+    case FORMAT_UNORM16:
+      return "unorm16";
+  }
+  return "unknown";
+}
+
+const char *DepthBuffer::layoutName(Layout layout)
+{
+  switch ( layout )
+  {
+    case LAYOUT_ROW_MAJOR:
+      return "row-major";
+    case LAYOUT_TILED:
+      return "tiled";
+  }
+  return "unknown";
+}
+
+DepthBuffer::DepthBuffer()
+  : m_format(FORMAT_FLOAT32),
+    m_layout(LAYOUT_ROW_MAJOR),
+    m_width(0),
+    m_height(0),
+    m_pitch(0),
+    m_blocksX(0),
+    m_data(0)
+{
+}
+
+void DepthBuffer::setFormat(Format format)
+{
+  if ( format == m_format )
+    return;
+  m_format = format;
+  release();
+}
+
+DepthBuffer::Format DepthBuffer::format() const
+{
+  return m_format;
+}
+
+void DepthBuffer::setLayout(Layout layout)
+{
+  if ( layout == m_layout )
+    return;
+  m_layout = layout;
+  release();
+}
+
+DepthBuffer::Layout DepthBuffer::layout() const
+{
+  return m_layout;
+}
+
+void DepthBuffer::resize(int width, int height)
+{
+  if ( m_data && width == m_width && height == m_height )
+    return;
+
+  m_width = width;
+  m_height = height;
+
+  // pad rows, or rows of blocks, to whole cache lines
+  const size_t pixel = bytesPerPixel(m_format);
+  const size_t per_line = ALIGNMENT / pixel;
+  size_t rows;
+  if ( m_layout == LAYOUT_ROW_MAJOR )
+  {
+    m_pitch = (size_t(width) + per_line - 1) / per_line * per_line;
+    m_blocksX = 0;
+    rows = height;
+  }
+  else
+  {
+    m_blocksX = (size_t(width) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    m_pitch = m_blocksX * BLOCK_SIZE * BLOCK_SIZE;
+    rows = (size_t(height) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  }
+
+  m_storage.resize(m_pitch * rows * pixel + ALIGNMENT);
+  const uintptr_t base = reinterpret_cast<uintptr_t>(&m_storage[0]);
+  m_data = &m_storage[0] + (ALIGNMENT - base % ALIGNMENT) % ALIGNMENT;
+}
+
+void DepthBuffer::release()
+{
+  std::vector<uint8_t>().swap(m_storage);
+  m_data = 0;
+  m_width = 0;
+  m_height = 0;
+}
+
+int DepthBuffer::width() const
+{
+  return m_width;
+}
+
+int DepthBuffer::height() const
+{
+  return m_height;
+}
+
+size_t DepthBuffer::bytes() const
+{
+  return m_storage.size();
+}
+
+void DepthBuffer::clear(const PixelRect &rect)
+{
+  for ( int y=rect.y0; y <= rect.y1; y++ )
+  {
+    if ( m_layout == LAYOUT_ROW_MAJOR )
+    {
+      const size_t i0 = index(rect.x0, y);
+      const size_t i1 = index(rect.x1, y) + 1;
+      switch ( m_format )
+      {
+        case FORMAT_FLOAT32:
+          std::fill(reinterpret_cast<float*>(m_data) + i0,
+                    reinterpret_cast<float*>(m_data) + i1, 1.0f);
+          break;
+        case FORMAT_UNORM24:
+          std::fill(reinterpret_cast<uint32_t*>(m_data) + i0,
+                    reinterpret_cast<uint32_t*>(m_data) + i1, 0xffffffu);
+          break;
+        case FORMAT_UNORM16:
+          std::fill(reinterpret_cast<uint16_t*>(m_data) + i0,
+                    reinterpret_cast<uint16_t*>(m_data) + i1, uint16_t(0xffff));
+          break;
+      }
+      continue;
+    }
+
+    for ( int x=rect.x0; x <= rect.x1; x++ )
+    {
+      const size_t i = index(x, y);
+      switch ( m_format )
+      {
+        case FORMAT_FLOAT32:
+          reinterpret_cast<float*>(m_data)[i] = 1.0f;
+          break;
+        case FORMAT_UNORM24:
+          reinterpret_cast<uint32_t*>(m_data)[i] = 0xffffff;
+          break;
+        case FORMAT_UNORM16:
+          reinterpret_cast<uint16_t*>(m_data)[i] = 0xffff;
+          break;
+      }
+    }
+  }
+}
+
+size_t DepthBuffer::covered(const PixelRect &rect) const
+{
+  // compare the stored values, which clear() sets to exactly the far depth
+  size_t n = 0;
+  for ( int y=rect.y0; y <= rect.y1; y++ )
+    for ( int x=rect.x0; x <= rect.x1; x++ )
+    {
+      const size_t i = index(x, y);
+      switch ( m_format )
+      {
+        case FORMAT_FLOAT32:
+          n += reinterpret_cast<const float*>(m_data)[i] < 1.0f;
+          break;
+        case FORMAT_UNORM24:
+          n += reinterpret_cast<const uint32_t*>(m_data)[i] < 0xffffffu;
+          break;
+        case FORMAT_UNORM16:
+          n += reinterpret_cast<const uint16_t*>(m_data)[i] < 0xffff;
+          break;
+      }
+    }
+  return n;
+}
+
+float DepthBuffer::at(int x, int y) const
+{
+  const size_t i = index(x, y);
+  switch ( m_format )
+  {
+    case FORMAT_FLOAT32:
+      return reinterpret_cast<const float*>(m_data)[i];
+    case FORMAT_UNORM24:
+      return reinterpret_cast<const uint32_t*>(m_data)[i] * (2.0f / 0xffffff) - 1.0f;
+    case FORMAT_UNORM16:
+      return reinterpret_cast<const uint16_t*>(m_data)[i] * (2.0f / 0xffff) - 1.0f;
+  }
+  return 1.0f;
+}
+
+float *DepthBuffer::floatRows()
+{
+  if ( m_format != FORMAT_FLOAT32 || m_layout != LAYOUT_ROW_MAJOR )
+    return 0;
+  return reinterpret_cast<float*>(m_data);
+}
+
+size_t DepthBuffer::floatPitch() const
+{
+  return m_pitch;
+}
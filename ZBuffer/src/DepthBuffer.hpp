@@ -0,0 +1,156 @@
+#ifndef __DEPTH_BUFFER_HPP__
+#define __DEPTH_BUFFER_HPP__
+
+#include <vector>
+#include <stdint.h>
+#include "Model.hpp"
+
+/** \brief Depth buffer with selectable storage.
+ *
+ * Depth in [-1, 1] is stored as 32-bit float, or as 24-bit or 16-bit
+ * unsigned normalized integers; 24-bit depth takes the low bits of 32-bit
+ * words, like the depth of a D24S8 buffer. Pixels are laid out in rows,
+ * or in BLOCK_SIZE*BLOCK_SIZE blocks stored one after another so that a
+ * block shares few cache lines. Rows, or rows of blocks, start on
+ * ALIGNMENT byte boundaries.
+ *
+ * Storage is only reallocated when the size, format or layout changes,
+ * so one buffer serves all frames of a widget.
+ */
+class DepthBuffer {
+public:
+  static const size_t ALIGNMENT = 64;
+  static const int BLOCK_SIZE = 8;
+
+  enum Format {
+    FORMAT_FLOAT32, ///< 4 bytes per pixel
+    FORMAT_UNORM24, ///< 4 bytes per pixel, 24 of them used
+    FORMAT_UNORM16  ///< 2 bytes per pixel
+  };
+  static const char *formatName(Format format);
+
+  enum Layout {
+    LAYOUT_ROW_MAJOR, ///< rows of pixels, bottom row first
+    LAYOUT_TILED      ///< rows of BLOCK_SIZE*BLOCK_SIZE blocks
+  };
+  static const char *layoutName(Layout layout);
+
+public:
+  DepthBuffer();
+
+public:
+  void setFormat(Format format);
+  Format format() const;
+  void setLayout(Layout layout);
+  Layout layout() const;
+
+  /** \brief Make room for width*height pixels, keeping the storage if
+   * nothing changed.
+   */
+  void resize(int width, int height);
+  /** \brief Free the storage.
+   */
+  void release();
+
+  int width() const;
+  int height() const;
+  /** \brief Bytes of storage, including the row padding.
+   */
+  size_t bytes() const;
+
+  /** \brief Set the pixels inside rect to the far depth 1.
+   */
+  void clear(const PixelRect &rect);
+  /** \brief Number of pixels inside rect nearer than the far depth 1.
+   */
+  size_t covered(const PixelRect &rect) const;
+
+  /** \brief Depth of pixel (x, y) converted back to float.
+   */
+  float at(int x, int y) const;
+
+  /** \brief Store depth d at pixel (x, y) if it is nearer than the stored
+   * depth, in the precision of the format.
+   */
+  bool testAndSet(int x, int y, float d);
+
+  /** \brief Float rows for vectorized access, or 0 unless the format is
+   * FORMAT_FLOAT32 in LAYOUT_ROW_MAJOR.
+   */
+  float *floatRows();
+  /** \brief Floats from one row to the next in floatRows().
+   */
+  size_t floatPitch() const;
+
+private:
+  size_t index(int x, int y) const;
+  static uint32_t quantize(float d, uint32_t max);
+
+private:
+  Format m_format;
+  Layout m_layout;
+  int m_width;
+  int m_height;
+  size_t m_pitch;   ///< elements per row of pixels or per row of blocks
+  size_t m_blocksX; ///< blocks per row in LAYOUT_TILED
+  std::vector<uint8_t> m_storage;
+  uint8_t *m_data;  ///< m_storage aligned to ALIGNMENT
+
+};
+
+inline size_t DepthBuffer::index(int x, int y) const
+{
+  if ( m_layout == LAYOUT_ROW_MAJOR )
+    return size_t(y) * m_pitch + x;
+
+  const size_t block = size_t(y / BLOCK_SIZE) * m_blocksX + x / BLOCK_SIZE;
+  return block * BLOCK_SIZE * BLOCK_SIZE + (y % BLOCK_SIZE) * BLOCK_SIZE + x % BLOCK_SIZE;
+}
+
+inline uint32_t DepthBuffer::quantize(float d, uint32_t max)
+{
+  // map [-1, 1] to [0, max], rounding to nearest
+  const float q = (d + 1.0f) * 0.5f * float(max) + 0.5f;
+  if ( !(q > 0.0f) )
+    return 0;
+  if ( q >= float(max) )
+    return max;
+  return uint32_t(q);
+}
+
+inline bool DepthBuffer::testAndSet(int x, int y, float d)
+{
+  const size_t i = index(x, y);
+  switch ( m_format )
+  {
+    case FORMAT_FLOAT32:
+    {
+      float &z = reinterpret_cast<float*>(m_data)[i];
+      if ( !(d < z) )
+        return false;
+      z = d;
+      return true;
+    }
+    case FORMAT_UNORM24:
+    {
+      uint32_t &z = reinterpret_cast<uint32_t*>(m_data)[i];
+      const uint32_t q = quantize(d, 0xffffff);
+      if ( q >= z )
+        return false;
+      z = q;
+      return true;
+    }
+    case FORMAT_UNORM16:
+    {
+      uint16_t &z = reinterpret_cast<uint16_t*>(m_data)[i];
+      const uint32_t q = quantize(d, 0xffff);
+      if ( q >= z )
+        return false;
+      z = uint16_t(q);
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif //__DEPTH_BUFFER_HPP__
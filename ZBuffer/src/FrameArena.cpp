@@ -0,0 +1,135 @@
+#include <new>
+#include <cstdlib>
+#include <algorithm>
+#include "FrameArena.hpp"
+
+const size_t FrameArena::ALIGNMENT;
+const size_t FrameArena::MIN_BLOCK_SIZE;
+
+#ifdef COUNT_ALLOCATIONS
+namespace {
+
+std::atomic<size_t> g_heapAllocations(0);
+
+}
+
+void *operator new(size_t bytes)
+{
+  g_heapAllocations++;
+  void *p = std::malloc(bytes ? bytes : 1);
+  if ( !p )
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t bytes)
+{
+  return operator new(bytes);
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  std::free(p);
+}
+#endif
+
+namespace {
+
+inline size_t alignUp(size_t bytes)
+{
+  return (bytes + FrameArena::ALIGNMENT - 1) / FrameArena::ALIGNMENT * FrameArena::ALIGNMENT;
+}
+
+}
+
+FrameArena::FrameArena()
+  : m_block(0),
+    m_capacity(0),
+    m_used(0),
+    m_overflow(0),
+    m_overflowBytes(0),
+    m_heapBlocks(0)
+{
+}
+
+FrameArena::~FrameArena()
+{
+  while ( m_overflow )
+  {
+    Overflow *next = m_overflow->next;
+    ::operator delete(m_overflow);
+    m_overflow = next;
+  }
+  ::operator delete(m_block);
+}
+
+void FrameArena::reset()
+{
+  const size_t used = std::min(size_t(m_used), m_capacity);
+  m_used = 0;
+  if ( !m_overflow && m_block )
+    return;
+
+  const size_t needed = used + m_overflowBytes;
+  while ( m_overflow )
+  {
+    Overflow *next = m_overflow->next;
+    ::operator delete(m_overflow);
+    m_overflow = next;
+  }
+  m_overflowBytes = 0;
+
+  // one block for all of the last frame, and half as much again
+  ::operator delete(m_block);
+  m_capacity = alignUp(std::max(MIN_BLOCK_SIZE, needed + needed / 2));
+  m_block = static_cast<char*>(::operator new(m_capacity));
+  m_heapBlocks++;
+}
+
+void *FrameArena::allocate(size_t bytes)
+{
+  bytes = alignUp(std::max(bytes, size_t(1)));
+  const size_t offset = m_used.fetch_add(bytes);
+  if ( offset + bytes <= m_capacity )
+    return m_block + offset;
+
+  // the block is full; fall back to the heap until the next reset
+  const size_t header = alignUp(sizeof(Overflow));
+  Overflow *overflow = static_cast<Overflow*>(::operator new(header + bytes));
+  std::lock_guard<std::mutex> lock(m_mutex);
+  overflow->next = m_overflow;
+  overflow->bytes = bytes;
+  m_overflow = overflow;
+  m_overflowBytes += bytes;
+  m_heapBlocks++;
+  return reinterpret_cast<char*>(overflow) + header;
+}
+
+size_t FrameArena::used() const
+{
+  return std::min(size_t(m_used), m_capacity) + m_overflowBytes;
+}
+
+size_t FrameArena::capacity() const
+{
+  return m_capacity;
+}
+
+size_t FrameArena::heapBlocks() const
+{
+  return m_heapBlocks;
+}
+
+size_t FrameArena::heapAllocations()
+{
+#ifdef COUNT_ALLOCATIONS
+  return g_heapAllocations;
+#else
+  return 0;
+#endif
+}
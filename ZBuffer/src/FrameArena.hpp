@@ -0,0 +1,142 @@
+#ifndef __FRAME_ARENA_HPP__
+#define __FRAME_ARENA_HPP__
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <stdint.h>
+
+/// Define to count every heap allocation of the program, for
+/// FrameArena::heapAllocations()
+//#define COUNT_ALLOCATIONS
+
+/** \brief Bump allocator for memory that lives for one frame.
+ *
+ * Allocations are carved from one block, from any thread, and nothing is
+ * freed until reset(). Allocations that do not fit go to the heap, and
+ * the next reset() replaces the block by one large enough for the whole
+ * last frame, with some room to spare. So once warmed up, frames of about
+ * the same size do not touch the heap.
+ */
+class FrameArena {
+public:
+  /// Alignment of every allocation
+  static const size_t ALIGNMENT = 16;
+  /// Size of the first block
+  static const size_t MIN_BLOCK_SIZE = 1 << 20;
+
+public:
+  FrameArena();
+  ~FrameArena();
+
+public:
+  /** \brief Release everything allocated since the last reset.
+   */
+  void reset();
+  /** \brief bytes of uninitialized memory, valid until the next reset.
+   */
+  void *allocate(size_t bytes);
+
+  /** \brief Bytes allocated since the last reset.
+   */
+  size_t used() const;
+  /** \brief Size of the block.
+   */
+  size_t capacity() const;
+  /** \brief Heap blocks allocated since construction, overflows included.
+   */
+  size_t heapBlocks() const;
+
+  /** \brief Heap allocations of the whole program so far, or 0 unless
+   * built with COUNT_ALLOCATIONS.
+   */
+  static size_t heapAllocations();
+
+private:
+  FrameArena(const FrameArena &);
+  FrameArena &operator=(const FrameArena &);
+
+private:
+  /// Header of an allocation that did not fit into the block
+  struct Overflow {
+    Overflow *next;
+    size_t bytes;
+  };
+
+  char *m_block;
+  size_t m_capacity;
+  std::atomic<size_t> m_used;
+  std::mutex m_mutex;
+  Overflow *m_overflow;
+  size_t m_overflowBytes;
+  size_t m_heapBlocks;
+
+};
+
+/** \brief Standard allocator drawing from a FrameArena, or from the heap
+ * without one.
+ *
+ * Containers using it must be emptied or replaced before the arena is
+ * reset.
+ */
+template <typename T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+public:
+  ArenaAllocator(FrameArena *arena=0)
+    : m_arena(arena)
+  {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &a)
+    : m_arena(a.arena())
+  {}
+
+  T *allocate(size_t n)
+  {
+    static_assert(std::alignment_of<T>::value <= FrameArena::ALIGNMENT,
+                  "type too strictly aligned for FrameArena");
+    if ( m_arena )
+      return static_cast<T*>(m_arena->allocate(n * sizeof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t)
+  {
+    if ( !m_arena )
+      ::operator delete(p);
+  }
+
+  FrameArena *arena() const
+  {
+    return m_arena;
+  }
+
+private:
+  FrameArena *m_arena;
+
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+  return a.arena() != b.arena();
+}
+
+/// Vector whose storage lives in a FrameArena
+template <typename T>
+using FrameVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif //__FRAME_ARENA_HPP__
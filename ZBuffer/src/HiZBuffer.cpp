@@ -0,0 +1,105 @@
+#include <algorithm>
+#include "HiZBuffer.hpp"
+
+namespace {
+
+/// Pixels of a level of the pyramid
+struct LevelSource {
+  const float *depth;
+  int width;
+
+  float at(int x, int y) const { return depth[size_t(y) * width + x]; }
+};
+
+/** \brief Keep the farthest depth of each 2x2 block of src, clamped at the
+ * borders.
+ */
+template <typename Source>
+void reduce(const Source &src, int src_width, int src_height,
+            float *dst, int dst_width, int dst_height)
+{
+  for ( int y=0; y < dst_height; y++ )
+  {
+    const int y0 = 2*y;
+    const int y1 = std::min(2*y+1, src_height-1);
+    for ( int x=0; x < dst_width; x++ )
+    {
+      const int x0 = 2*x;
+      const int x1 = std::min(2*x+1, src_width-1);
+      dst[size_t(y) * dst_width + x] = std::max(std::max(src.at(x0, y0), src.at(x1, y0)),
+                                                std::max(src.at(x0, y1), src.at(x1, y1)));
+    }
+  }
+}
+
+}
+
+HiZBuffer::HiZBuffer()
+{
+}
+
+void HiZBuffer::build(const DepthBuffer &depth)
+{
+  // levels of the last build are reused, so a frame of the same size
+  // allocates nothing
+  size_t n = 0;
+  int src_width = depth.width();
+  int src_height = depth.height();
+
+  while ( src_width > 1 || src_height > 1 )
+  {
+    if ( m_levels.size() == n )
+      m_levels.push_back(Level());
+    Level &level = m_levels[n++];
+    level.width = (src_width + 1) / 2;
+    level.height = (src_height + 1) / 2;
+    level.depth.resize(size_t(level.width) * level.height);
+
+    // level 0 reads the depth buffer in whatever format it stores
+    if ( n == 1 )
+    {
+      reduce(depth, src_width, src_height, &level.depth[0], level.width, level.height);
+    }
+    else
+    {
+      const Level &below = m_levels[n-2];
+      const LevelSource src = {&below.depth[0], below.width};
+      reduce(src, src_width, src_height, &level.depth[0], level.width, level.height);
+    }
+
+    src_width = level.width;
+    src_height = level.height;
+  }
+  m_levels.resize(n);
+}
+
+bool HiZBuffer::occluded(const PixelRect &rect, float near) const
+{
+  if ( rect.empty() || m_levels.empty() )
+    return false;
+
+  // find the finest level where rect covers at most 2x2 texels
+  size_t l = 0;
+  int shift = 1;
+  while ( l+1 < m_levels.size()
+    && ( (rect.x1 >> shift) - (rect.x0 >> shift) > 1
+      || (rect.y1 >> shift) - (rect.y0 >> shift) > 1 ) )
+  {
+    l++;
+    shift++;
+  }
+
+  const Level &level = m_levels[l];
+  const int x0 = std::max(rect.x0 >> shift, 0);
+  const int y0 = std::max(rect.y0 >> shift, 0);
+  const int x1 = std::min(rect.x1 >> shift, level.width-1);
+  const int y1 = std::min(rect.y1 >> shift, level.height-1);
+
+  for ( int y=y0; y <= y1; y++ )
+    for ( int x=x0; x <= x1; x++ )
+    {
+      if ( level.depth[size_t(y) * level.width + x] >= near )
+        return false;
+    }
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef __HIZ_BUFFER_HPP__
+#define __HIZ_BUFFER_HPP__
+
+#include <vector>
+#include "Model.hpp"
+#include "DepthBuffer.hpp"
+
+/** \brief Hierarchical Z pyramid over a depth buffer, after Greene et al.
+ *
+ * Level 0 holds the farthest depth of each 2x2 block of pixels, and each
+ * further level the farthest depth of 2x2 texels of the level below, up
+ * to a single texel. A screen rectangle is then tested against at most
+ * 2x2 texels of the finest level that covers it with so few.
+ */
+class HiZBuffer {
+public:
+  HiZBuffer();
+
+public:
+  /** \brief Build the pyramid over a depth buffer.
+   */
+  void build(const DepthBuffer &depth);
+
+  /** \brief Whether anything inside rect at depth near or farther is hidden.
+   */
+  bool occluded(const PixelRect &rect, float near) const;
+
+private:
+  struct Level {
+    int width, height;
+    std::vector<float> depth;
+  };
+
+private:
+  std::vector<Level> m_levels;
+
+};
+
+#endif //__HIZ_BUFFER_HPP__
@@ -1,7 +1,23 @@
 #include <Eigen/Dense>
 #include "Model.hpp"
 #include "Logger.hpp"
+#include "RasterSIMD.hpp"
 #include <algorithm>
+#include <cmath>
+
+const int TriangleBase::SHININESS;
+const float TriangleBase::DIFFUSE[3] = {0.929524f, 0.796542f, 0.178823f};
+const float TriangleBase::SPECULAR[3] = {1.00000f, 0.980392f, 0.549020f};
+const float TriangleBase::LIGHT_POSITION[3] = {0.0f, 5.0f, 0.0f};
+
+const int TriangleBase::BLOCK_SIZE;
+const size_t Model::BVH_LEAF_SIZE;
+const size_t Model::MESHLET_VERTICES;
+const size_t Model::MESHLET_TRIANGLES;
+const size_t Model::GEOMETRY_CHUNKS;
+const size_t Model::SOA_WIDTH;
+const int Model::GUARD_BAND;
+static_assert(Model::SOA_WIDTH % RasterSIMD::WIDTH == 0, "SoA padding too small for SIMD");
 
 Model::Model(const char *filename)
   : m_filename(filename)
@@ -9,9 +25,25 @@ Model::Model(const char *filename)
   std::string err = tinyobj::LoadObj(m_shapes, filename);
   ASSERT_MSG(err.empty(), "%s", err.c_str());
 
+  m_bvh.resize(m_shapes.size());
+  m_bvhTriangles.resize(m_shapes.size());
+  m_meshlets.resize(m_shapes.size());
+  m_meshletBatches.resize(m_shapes.size());
+  m_soa.resize(m_shapes.size());
+  m_transformed.resize(m_shapes.size());
+  m_transformedDouble.resize(m_shapes.size());
+  m_winding.resize(m_shapes.size());
   for ( size_t i=0; i < m_shapes.size(); i++ ) {
-    if ( m_shapes[i].mesh.normals.empty() )
+    const bool has_normals = !m_shapes[i].mesh.normals.empty();
+    m_winding[i] = detect_winding(i, has_normals);
+    if ( m_winding[i] != WINDING_CCW )
+      INFO("Shape %lu: %s winding", i, windingName(m_winding[i]));
+    if ( !has_normals )
       calculate_normal(i);
+    build_bvh(i);
+    reorder_vertices(i);
+    build_meshlets(i);
+    build_soa(i);
   }
 }
 
@@ -89,6 +121,114 @@ void *Model::indexData(size_t i)
   return (void*)&(m_shapes[i].mesh.indices[0]);
 }
 
+const std::vector<BVHNode> &Model::bvh(size_t i) const
+{
+  return m_bvh[i];
+}
+
+Frustum::Frustum(const Matrix4 &transform)
+{
+  for ( int i=0; i < 3; i++ )
+  {
+    planes[2*i] = (transform.row(3) + transform.row(i)).transpose();
+    planes[2*i+1] = (transform.row(3) - transform.row(i)).transpose();
+  }
+}
+
+Frustum::Test Frustum::test(const BVHNode &node) const
+{
+  const Vector3 center = (node.lo + node.hi).cast<double>() / 2.0;
+  const Vector3 extent = (node.hi - node.lo).cast<double>() / 2.0;
+
+  Test result = INSIDE;
+  for ( size_t i=0; i < 6; i++ )
+  {
+    const Vector3 n = planes[i].head<3>();
+    const double distance = n.dot(center) + planes[i].w();
+    const double radius = n.cwiseAbs().dot(extent);
+    if ( distance + radius < 0.0 )
+      return OUTSIDE;
+    if ( distance - radius < 0.0 )
+      result = INTERSECTING;
+  }
+  return result;
+}
+
+const char *Model::cullModeName(CullMode mode)
+{
+  switch ( mode )
+  {
+    case CULL_NONE:
+      return "no culling";
+    case CULL_BACK:
+      return "back face culling";
+    case CULL_FRONT:
+      return "front face culling";
+  }
+  return "unknown";
+}
+
+const char *Model::windingName(Winding winding)
+{
+  switch ( winding )
+  {
+    case WINDING_CCW:
+      return "counter-clockwise";
+    case WINDING_CW:
+      return "clockwise";
+  }
+  return "unknown";
+}
+
+Model::Winding Model::winding(size_t i) const
+{
+  return m_winding[i];
+}
+
+void Model::setWinding(size_t i, Winding winding)
+{
+  if ( m_winding[i] == winding )
+    return;
+
+  // the normal cones point the other way now
+  m_winding[i] = winding;
+  build_meshlets(i);
+}
+
+Model::Winding Model::detect_winding(size_t idx, bool has_normals) const
+{
+  const std::vector<unsigned int> & indices = m_shapes[idx].mesh.indices;
+  const std::vector<float> & positions = m_shapes[idx].mesh.positions;
+  const std::vector<float> & normals = m_shapes[idx].mesh.normals;
+
+  // With normals, each face votes by whether the normal of its counter-
+  // clockwise winding points the way of its vertex normals. Without,
+  // the enclosed volume of a closed counter-clockwise mesh is positive.
+  double votes = 0.0;
+  for ( size_t i=0; i < indices.size(); i += 3 )
+  {
+    Vector3 v[3];
+    for ( size_t k=0; k < 3; k++ )
+      v[k] = Vector3(positions[3*indices[i+k]], positions[3*indices[i+k]+1],
+                     positions[3*indices[i+k]+2]);
+
+    if ( has_normals )
+    {
+      Vector3 n(Vector3::Zero());
+      for ( size_t k=0; k < 3; k++ )
+        n += Vector3(normals[3*indices[i+k]], normals[3*indices[i+k]+1],
+                     normals[3*indices[i+k]+2]);
+      const float d = (v[1]-v[0]).cross(v[2]-v[0]).dot(n);
+      votes += d > 0.0f ? 1.0 : d < 0.0f ? -1.0 : 0.0;
+    }
+    else
+    {
+      votes += v[0].dot(v[1].cross(v[2]));
+    }
+  }
+  return votes < 0.0 ? WINDING_CW : WINDING_CCW;
+}
+
 void Model::calculate_normal(size_t idx)
 {
   // Index is assumed
@@ -132,182 +272,1098 @@ void Model::calculate_normal(size_t idx)
   }
 }
 
-void Model::getTriangles(std::vector<Triangle> &triangles, const Matrix4 &transform)
+namespace {
+
+/// Orders triangles by the centroid coordinate along one axis
+struct CentroidLess {
+  const std::vector<EigenTypes::Vector3> &centroids;
+  int axis;
+
+  CentroidLess(const std::vector<EigenTypes::Vector3> &centroids, int axis)
+    : centroids(centroids), axis(axis)
+  {}
+
+  bool operator()(uint32_t a, uint32_t b) const
+  {
+    return centroids[a](axis) < centroids[b](axis);
+  }
+};
+
+/// Orders triangles by the class of their normal
+struct FacingLess {
+  const std::vector<uint8_t> &facing;
+
+  FacingLess(const std::vector<uint8_t> &facing)
+    : facing(facing)
+  {}
+
+  bool operator()(uint32_t a, uint32_t b) const
+  {
+    return facing[a] < facing[b];
+  }
+};
+
+/// Orders meshlets by their first triangle
+struct MeshletLess {
+  bool operator()(const Meshlet &a, const Meshlet &b) const
+  {
+    return a.first < b.first;
+  }
+};
+
+}
+
+void Model::build_bvh(size_t idx)
 {
-  //const Matrix4 normal_transform = (transform.transpose()*transform).inverse()*transform.transpose();
-  const Matrix4 normal_transform = transform.adjoint().transpose();
-  //const Matrix4 normal_transform = transform.inverse().transpose();
-  //const Matrix4 &normal_transform = transform;
+  const std::vector<unsigned int> & indices = m_shapes[idx].mesh.indices;
+  const std::vector<float> & positions = m_shapes[idx].mesh.positions;
+  const size_t n = indices.size() / 3;
+
+  std::vector<BVHNode> & nodes = m_bvh[idx];
+  std::vector<uint32_t> & order = m_bvhTriangles[idx];
+  nodes.clear();
+  order.resize(n);
+  if ( n == 0 )
+    return;
+
+  std::vector<Vector3> centroids(n);
+  for ( size_t i=0; i < n; i++ )
+  {
+    order[i] = uint32_t(i);
+    centroids[i] = Vector3::Zero();
+    for ( size_t k=0; k < 3; k++ )
+      centroids[i] += Vector3(positions[3*indices[3*i+k]],
+                              positions[3*indices[3*i+k]+1],
+                              positions[3*indices[3*i+k]+2]) / 3.0;
+  }
+
+  BVHNode root;
+  root.count = uint32_t(n);
+  nodes.push_back(root);
+
+  std::vector<uint32_t> stack(1, 0);
+  while ( !stack.empty() )
+  {
+    const uint32_t i = stack.back();
+    stack.pop_back();
+    const uint32_t first = nodes[i].first;
+    const uint32_t count = nodes[i].count;
 
-  float x[2] = {99999.f, -99999.f};
-  float y[2] = {99999.f, -99999.f};
-  float z[2] = {99999.f, -99999.f};
+    // bound the triangles and their centroids
+    Vector3 lo = Vector3::Constant(HUGE_VAL), hi = -lo;
+    Vector3 clo = lo, chi = hi;
+    for ( uint32_t j=first; j < first+count; j++ )
+    {
+      for ( size_t k=0; k < 3; k++ )
+      {
+        const unsigned int v = indices[3*order[j]+k];
+        const Vector3 p(positions[3*v], positions[3*v+1], positions[3*v+2]);
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+      }
+      clo = clo.cwiseMin(centroids[order[j]]);
+      chi = chi.cwiseMax(centroids[order[j]]);
+    }
+    nodes[i].lo = lo;
+    nodes[i].hi = hi;
+
+    if ( count <= BVH_LEAF_SIZE )
+      continue;
+
+    // split at the median along the longest axis of the centroids
+    int axis;
+    (chi - clo).maxCoeff(&axis);
+    const uint32_t half = count / 2;
+    std::nth_element(order.begin()+first, order.begin()+first+half,
+                     order.begin()+first+count, CentroidLess(centroids, axis));
+
+    BVHNode child;
+    child.first = first;
+    child.count = half;
+    nodes[i].left = uint32_t(nodes.size());
+    nodes.push_back(child);
+    child.first = first + half;
+    child.count = count - half;
+    nodes[i].right = uint32_t(nodes.size());
+    nodes.push_back(child);
+
+    stack.push_back(nodes[i].right);
+    stack.push_back(nodes[i].left);
+  }
+}
 
-  size_t n_filtered = 0;
-  size_t n_remained = 0;
+template <typename Scalar>
+void Model::getTriangles(FrameVector<TriangleT<Scalar> > &triangles,
+                         const typename EigenTypesT<Scalar>::Matrix4 &modelView,
+                         const typename EigenTypesT<Scalar>::Matrix4 &projection,
+                         CullMode cull, GeometryStats &stats, ThreadPool *pool)
+{
+  const Frustum frustum(projection.template cast<double>() * modelView.template cast<double>());
+  FrameVector<uint32_t> stack(triangles.get_allocator());
+  FrameVector<NodeRef> visible(triangles.get_allocator());
 
   for ( size_t i=0; i < m_shapes.size(); i++ )
   {
-    const std::vector<unsigned int> & indices = m_shapes[i].mesh.indices;
-    const std::vector<float> & positions = m_shapes[i].mesh.positions;
-    const std::vector<float> & normals = m_shapes[i].mesh.normals;
+    const std::vector<BVHNode> &nodes = m_bvh[i];
+    if ( nodes.empty() )
+      continue;
 
-    for ( size_t j=0; j < indices.size(); j += 3 )
+    // walk the BVH, taking subtrees inside the frustum without testing
+    // their children and skipping the ones outside
+    stack.assign(1, 0);
+    while ( !stack.empty() )
     {
-      Triangle t;
+      const uint32_t n = stack.back();
+      const BVHNode &node = nodes[n];
+      stack.pop_back();
 
-      // do the transformation
-      for ( size_t k=0; k < 3; k++ )
+      stats.nodesTested++;
+      const Frustum::Test test = frustum.test(node);
+      if ( test == Frustum::OUTSIDE )
       {
-        Vector4 v(positions[3*indices[j+k]], positions[3*indices[j+k]+1], positions[3*indices[j+k]+2], 1.0);
-        v = transform * v;
-        v /= v.w();
-        t.vertices[k] = Vector3(v.x(), v.y(), v.z());
+        stats.nodesCulled++;
+        stats.skipped += node.count;
       }
+      else if ( test == Frustum::INSIDE || node.isLeaf() )
+      {
+        visible.push_back(NodeRef(uint32_t(i), n));
+      }
+      else
+      {
+        stack.push_back(node.right);
+        stack.push_back(node.left);
+      }
+    }
+  }
 
-      // do statistics about vertex info
-      for ( size_t k=0; k < 3; k++ )
+  getTriangles(triangles, modelView, projection, visible, cull, stats, pool);
+}
+
+template <typename Scalar>
+void Model::getTriangles(FrameVector<TriangleT<Scalar> > &triangles,
+                         const typename EigenTypesT<Scalar>::Matrix4 &modelView,
+                         const typename EigenTypesT<Scalar>::Matrix4 &projection,
+                         const FrameVector<NodeRef> &nodes,
+                         CullMode cull, GeometryStats &stats, ThreadPool *pool)
+{
+  typedef FrameVector<TriangleT<Scalar> > Triangles;
+  const ArenaAllocator<TriangleT<Scalar> > alloc = triangles.get_allocator();
+  const size_t threads = pool ? pool->numThreads() : 1;
+  const size_t chunks = threads > 1 ? GEOMETRY_CHUNKS * threads : 1;
+  // jobs are wrapped by reference, so that no std::function allocates
+  const auto run = [pool](size_t count, const ThreadPool::Job &job) {
+    if ( pool )
+      pool->run(count, job);
+    else
+      for ( size_t i=0; i < count; i++ )
+        job(i);
+  };
+
+  // queue the meshlets of the nodes that face the viewer, and the vertex
+  // batches they need
+  FrameVector<NodeRef> meshlet_queue(alloc);
+  FrameVector<NodeRef> batch_queue(alloc);
+  for ( size_t i=0; i < nodes.size(); i++ )
+  {
+    const uint32_t shape = nodes[i].first;
+    const BVHNode &node = m_bvh[shape][nodes[i].second];
+    transform_vertices(shape, modelView, projection);
+    const std::vector<Meshlet> &meshlets = m_meshlets[shape];
+    const std::vector<uint32_t> &batches = m_meshletBatches[shape];
+    TransformedVertices<Scalar> &tv = transformed(shape, Scalar());
+    const bool cone_culling = cull == CULL_BACK && tv.hasEye;
+
+    // meshlets do not straddle leaves, so the node's range is made of
+    // whole meshlets
+    Meshlet key;
+    key.first = node.first;
+    const size_t first = std::lower_bound(meshlets.begin(), meshlets.end(), key, MeshletLess())
+                       - meshlets.begin();
+    for ( size_t j=first; j < meshlets.size() && meshlets[j].first < node.first+node.count; j++ )
+    {
+      const Meshlet &m = meshlets[j];
+      if ( cone_culling )
       {
-        x[0] = std::min(x[0], (float)(t.vertices[k].x()));
-        x[1] = std::max(x[1], (float)(t.vertices[k].x()));
-        y[0] = std::min(y[0], (float)(t.vertices[k].y()));
-        y[1] = std::max(y[1], (float)(t.vertices[k].y()));
-        z[0] = std::min(z[0], (float)(t.vertices[k].z()));
-        z[1] = std::max(z[1], (float)(t.vertices[k].z()));
+        stats.meshletsTested++;
+        const Eigen::Vector3d d = m.apex.cast<double>() - tv.eye;
+        if ( d.dot(m.axis.cast<double>()) >= m.cutoff * d.norm() )
+        {
+          stats.meshletsCulled++;
+          stats.coneSkipped += m.count;
+          continue;
+        }
       }
 
-      // filter out this triangle if all three vertices are outside of the viewing volume
-      if ( (t.vertices[0].x() < -1.0f || t.vertices[0].x() > 1.0f ||
-            t.vertices[0].y() < -1.0f || t.vertices[0].y() > 1.0f ||
-            t.vertices[0].z() < -1.0f || t.vertices[0].z() > 1.0f )
-        && (t.vertices[1].x() < -1.0f || t.vertices[1].x() > 1.0f ||
-            t.vertices[1].y() < -1.0f || t.vertices[1].y() > 1.0f ||
-            t.vertices[1].z() < -1.0f || t.vertices[1].z() > 1.0f )
-        && (t.vertices[2].x() < -1.0f || t.vertices[2].x() > 1.0f ||
-            t.vertices[2].y() < -1.0f || t.vertices[2].y() > 1.0f ||
-            t.vertices[2].z() < -1.0f || t.vertices[2].z() > 1.0f ) )
+      meshlet_queue.push_back(NodeRef(shape, uint32_t(j)));
+      for ( uint32_t k=m.firstBatch; k < m.firstBatch+m.batches; k++ )
+        if ( tv.batches[batches[k]] == BATCH_PENDING )
+        {
+          tv.batches[batches[k]] = BATCH_QUEUED;
+          batch_queue.push_back(NodeRef(shape, batches[k]));
+        }
+    }
+  }
+
+  // transform the batches, then assemble the meshlets, each in contiguous
+  // chunks; the first chunk appends to triangles, the others to buffers
+  FrameVector<GeometryStats> chunk_stats(chunks, GeometryStats(), alloc);
+  const auto transform_chunk = [&](size_t c) {
+    const size_t n = batch_queue.size();
+    for ( size_t i=n*c/chunks; i < n*(c+1)/chunks; i++ )
+      transform_batch(batch_queue[i].first, batch_queue[i].second, chunk_stats[c], Scalar());
+  };
+  run(chunks, std::cref(transform_chunk));
+
+  FrameVector<Triangles> buffers(chunks, Triangles(alloc), alloc);
+  const auto assemble_chunk = [&](size_t c) {
+    Triangles &out = c ? buffers[c] : triangles;
+    const size_t n = meshlet_queue.size();
+    for ( size_t i=n*c/chunks; i < n*(c+1)/chunks; i++ )
+    {
+      const uint32_t shape = meshlet_queue[i].first;
+      const Meshlet &m = m_meshlets[shape][meshlet_queue[i].second];
+      const std::vector<uint32_t> &order = m_bvhTriangles[shape];
+      for ( size_t j=m.first; j < m.first+m.count; j++ )
+        assemble_triangle(out, shape, 3*size_t(order[j]), cull, chunk_stats[c]);
+    }
+  };
+  run(chunks, std::cref(assemble_chunk));
+
+  // merge: each buffer is copied to its place in submission order
+  FrameVector<size_t> offsets(chunks+1, triangles.size(), alloc);
+  for ( size_t c=0; c < chunks; c++ )
+  {
+    offsets[c+1] = offsets[c] + (c ? buffers[c].size() : 0);
+    stats.vertices += chunk_stats[c].vertices;
+    stats.normalsReused += chunk_stats[c].normalsReused;
+    stats.positionsReused += chunk_stats[c].positionsReused;
+    stats.assembled += chunk_stats[c].assembled;
+    stats.outside += chunk_stats[c].outside;
+    stats.clipped += chunk_stats[c].clipped;
+    stats.culled += chunk_stats[c].culled;
+  }
+  if ( chunks == 1 )
+    return;
+  triangles.resize(offsets[chunks]);
+  const auto copy_chunk = [&](size_t c) {
+    std::copy(buffers[c+1].begin(), buffers[c+1].end(), triangles.begin() + offsets[c+1]);
+  };
+  run(chunks-1, std::cref(copy_chunk));
+}
+
+void Model::reorder_vertices(size_t idx)
+{
+  tinyobj::mesh_t & mesh = m_shapes[idx].mesh;
+  const std::vector<uint32_t> & order = m_bvhTriangles[idx];
+  const size_t n = mesh.positions.size() / 3;
+  const unsigned int unused = ~0u;
+
+  // number the vertices by first use, the unused ones last
+  std::vector<unsigned int> remap(n, unused);
+  unsigned int next = 0;
+  for ( size_t i=0; i < order.size(); i++ )
+    for ( size_t k=0; k < 3; k++ )
+    {
+      const unsigned int v = mesh.indices[3*size_t(order[i])+k];
+      if ( remap[v] == unused )
+        remap[v] = next++;
+    }
+  for ( size_t i=0; i < n; i++ )
+    if ( remap[i] == unused )
+      remap[i] = next++;
+
+  std::vector<float> positions(mesh.positions.size());
+  std::vector<float> normals(mesh.normals.size());
+  std::vector<float> texcoords(mesh.texcoords.size());
+  for ( size_t i=0; i < n; i++ )
+  {
+    const size_t r = remap[i];
+    for ( size_t k=0; k < 3; k++ )
+    {
+      positions[3*r+k] = mesh.positions[3*i+k];
+      normals[3*r+k] = mesh.normals[3*i+k];
+    }
+    if ( texcoords.size() == 2*n )
+    {
+      texcoords[2*r] = mesh.texcoords[2*i];
+      texcoords[2*r+1] = mesh.texcoords[2*i+1];
+    }
+  }
+  mesh.positions.swap(positions);
+  mesh.normals.swap(normals);
+  if ( texcoords.size() == 2*n )
+    mesh.texcoords.swap(texcoords);
+
+  for ( size_t i=0; i < mesh.indices.size(); i++ )
+    mesh.indices[i] = remap[mesh.indices[i]];
+}
+
+void Model::build_meshlets(size_t idx)
+{
+  const std::vector<unsigned int> & indices = m_shapes[idx].mesh.indices;
+  const std::vector<float> & positions = m_shapes[idx].mesh.positions;
+  const std::vector<BVHNode> & nodes = m_bvh[idx];
+  std::vector<uint32_t> & order = m_bvhTriangles[idx];
+  const float sign = m_winding[idx] == WINDING_CW ? -1.0f : 1.0f;
+
+  // class the triangles by the dominant axis and sign of their normal,
+  // degenerate ones last, so that meshlets have narrow normal cones
+  const size_t n = indices.size() / 3;
+  std::vector<uint8_t> facing(n);
+  for ( size_t i=0; i < n; i++ )
+  {
+    Vector3 v[3];
+    for ( size_t k=0; k < 3; k++ )
+      v[k] = Vector3(positions[3*indices[3*i+k]], positions[3*indices[3*i+k]+1],
+                     positions[3*indices[3*i+k]+2]);
+    const Vector3 normal = sign * (v[1]-v[0]).cross(v[2]-v[0]);
+    int axis;
+    normal.cwiseAbs().maxCoeff(&axis);
+    facing[i] = normal.norm() == 0.0f ? 6 : uint8_t(2*axis + (normal(axis) < 0.0f));
+  }
+
+  // the leaves, in BVH order
+  std::vector<std::pair<uint32_t, uint32_t> > leaves;
+  for ( size_t i=0; i < nodes.size(); i++ )
+    if ( nodes[i].isLeaf() )
+      leaves.push_back(std::make_pair(nodes[i].first, nodes[i].count));
+  std::sort(leaves.begin(), leaves.end());
+
+  // sort the triangles of each leaf by class and pack them greedily,
+  // marking the vertices of the meshlet being filled with its number
+  std::vector<Meshlet> & meshlets = m_meshlets[idx];
+  meshlets.clear();
+  std::vector<uint32_t> mark(positions.size() / 3, ~0u);
+  size_t n_vertices = 0;
+  for ( size_t l=0; l < leaves.size(); l++ )
+  {
+    const uint32_t end = leaves[l].first + leaves[l].second;
+    std::stable_sort(order.begin()+leaves[l].first, order.begin()+end, FacingLess(facing));
+    for ( uint32_t i=leaves[l].first; i < end; i++ )
+    {
+      size_t added = 0;
+      if ( i != leaves[l].first )
+        for ( size_t k=0; k < 3; k++ )
+          added += mark[indices[3*size_t(order[i])+k]] != meshlets.size()-1;
+
+      if ( i == leaves[l].first
+        || facing[order[i]] != facing[order[i-1]]
+        || meshlets.back().count == MESHLET_TRIANGLES
+        || n_vertices + added > MESHLET_VERTICES )
       {
-        n_filtered++;
-        continue;
+        Meshlet m;
+        m.first = i;
+        meshlets.push_back(m);
+        n_vertices = 0;
       }
 
-#if 1
-      // transform the normals as well
       for ( size_t k=0; k < 3; k++ )
       {
-        Vector4 n(normals[3*indices[j+k]], normals[3*indices[j+k]+1], normals[3*indices[j+k]+2], 1.0);
-        n = normal_transform * n;
-        t.normals[k] = Vector3(n.x()/n.w(), n.y()/n.w(), n.z()/n.w());
-        t.normals[k].normalize();
+        uint32_t &v = mark[indices[3*size_t(order[i])+k]];
+        if ( v != meshlets.size()-1 )
+        {
+          v = uint32_t(meshlets.size()-1);
+          n_vertices++;
+        }
       }
-#else
+      meshlets.back().count++;
+    }
+  }
+
+  // list the vertex batches of each meshlet
+  std::vector<uint32_t> & batches = m_meshletBatches[idx];
+  batches.clear();
+  for ( size_t i=0; i < meshlets.size(); i++ )
+  {
+    Meshlet &m = meshlets[i];
+    m.firstBatch = uint32_t(batches.size());
+    for ( uint32_t j=m.first; j < m.first+m.count; j++ )
+      for ( size_t k=0; k < 3; k++ )
+        batches.push_back(uint32_t(indices[3*size_t(order[j])+k] / SOA_WIDTH));
+    std::sort(batches.begin()+m.firstBatch, batches.end());
+    batches.erase(std::unique(batches.begin()+m.firstBatch, batches.end()), batches.end());
+    m.batches = uint32_t(batches.size()) - m.firstBatch;
+  }
+
+  // bound the normals by a cone whose apex sees the back of every
+  // triangle from wherever it sees the back of the cone
+  std::vector<Vector3> corners;
+  std::vector<Vector3> normals;
+  for ( size_t i=0; i < meshlets.size(); i++ )
+  {
+    Meshlet &m = meshlets[i];
+    corners.clear();
+    normals.clear();
+    Vector3 lo = Vector3::Constant(HUGE_VAL), hi = -lo;
+    Vector3 sum(Vector3::Zero());
+    for ( uint32_t j=m.first; j < m.first+m.count; j++ )
+    {
+      Vector3 v[3];
+      for ( size_t k=0; k < 3; k++ )
       {
-        Vector3 a = t.vertices[1] - t.vertices[0];
-        Vector3 b = t.vertices[2] - t.vertices[0];
-        t.normals[0] = t.normals[1] = t.normals[2]
-          = a.cross(b).normalized();
+        const unsigned int c = indices[3*size_t(order[j])+k];
+        v[k] = Vector3(positions[3*c], positions[3*c+1], positions[3*c+2]);
+        lo = lo.cwiseMin(v[k]);
+        hi = hi.cwiseMax(v[k]);
       }
-#endif
 
-      // filter out this triangle if it's facing backward to viewer
-      // TODO: find out better solution
-      if (0)
-      //if ( t.normals[0].z() < 0 || t.normals[1].z() < 0 || t.normals[2].z() < 0 )
-      //if ( t.normals[0].z() + t.normals[1].z() + t.normals[2].z() < 0 )
-      {
-        n_filtered++;
+      // degenerate triangles have no area to cull either way
+      const Vector3 n = sign * (v[1]-v[0]).cross(v[2]-v[0]);
+      if ( n.norm() == 0.0f )
         continue;
-      }
-      if (0)
-      {
-        Vector3 n = t.normals[0] + t.normals[1] + t.normals[2];
-        n.normalize();
+      corners.push_back(v[0]);
+      normals.push_back(n.normalized());
+      sum += normals.back();
+    }
 
-        INFO("normal = (%.2f, %.2f, %.2f)", n.x(), n.y(), n.z());
-      }
+    m.apex = (lo + hi) / 2.0f;
+    m.axis = Vector3::UnitZ();
+    m.cutoff = 2.0f;
+    if ( normals.empty() || sum.norm() == 0.0f )
+      continue;
+    m.axis = sum.normalized();
+
+    float min_dot = 1.0f;
+    for ( size_t j=0; j < normals.size(); j++ )
+      min_dot = std::min(min_dot, normals[j].dot(m.axis));
+    if ( min_dot <= 0.0f )
+      continue;
+
+    float max_t = 0.0f;
+    for ( size_t j=0; j < normals.size(); j++ )
+      max_t = std::max(max_t, (m.apex - corners[j]).dot(normals[j]) / m.axis.dot(normals[j]));
+    m.apex -= m.axis * max_t;
+    m.cutoff = std::sqrt(1.0f - min_dot*min_dot);
+  }
+}
+
+void Model::build_soa(size_t idx)
+{
+  const std::vector<float> & positions = m_shapes[idx].mesh.positions;
+  const std::vector<float> & normals = m_shapes[idx].mesh.normals;
+
+  SoAVertices &soa = m_soa[idx];
+  soa.count = positions.size() / 3;
+  soa.padded = (soa.count + SOA_WIDTH - 1) / SOA_WIDTH * SOA_WIDTH;
+  soa.data.resize(6 * soa.padded);
+  std::fill(soa.data.data(), soa.data.data() + soa.data.size(), 0.0f);
 
-      triangles.push_back(t);
-      n_remained++;
+  for ( size_t i=0; i < soa.count; i++ )
+    for ( size_t k=0; k < 3; k++ )
+    {
+      soa.data[k * soa.padded + i] = positions[3*i+k];
+      soa.data[(3+k) * soa.padded + i] = normals[3*i+k];
     }
+}
+
+const Model::TransformedVertices<float> &Model::transformed(size_t shape, float) const
+{
+  return m_transformed[shape];
+}
+
+const Model::TransformedVertices<double> &Model::transformed(size_t shape, double) const
+{
+  return m_transformedDouble[shape];
+}
+
+Model::TransformedVertices<float> &Model::transformed(size_t shape, float)
+{
+  return m_transformed[shape];
+}
+
+Model::TransformedVertices<double> &Model::transformed(size_t shape, double)
+{
+  return m_transformedDouble[shape];
+}
+
+namespace {
+
+/** \brief The point of model space that a perspective transform maps to
+ * the center of projection, false for a parallel projection.
+ *
+ * It is where the clip space x, y and w of transform all vanish.
+ */
+bool findEye(const Eigen::Matrix4d &transform, Eigen::Vector3d &eye)
+{
+  Eigen::Matrix3d a;
+  Eigen::Vector3d b;
+  const int rows[3] = {0, 1, 3};
+  for ( int i=0; i < 3; i++ )
+  {
+    a.row(i) = transform.block<1, 3>(rows[i], 0);
+    b(i) = -transform(rows[i], 3);
   }
-  INFO("range of x (before clip): (%.2f, %.2f)", x[0], x[1]);
-  INFO("range of y (before clip): (%.2f, %.2f)", y[0], y[1]);
-  INFO("range of z (before clip): (%.2f, %.2f)", z[0], z[1]);
-  INFO("filtered: %.2f%% (%lu/%lu)", 100.0f*n_filtered/(n_filtered+n_remained), n_filtered, n_filtered+n_remained);
+
+  const double det = a.determinant();
+  if ( std::fabs(det) < 1e-12 * a.cwiseAbs().maxCoeff() )
+    return false;
+  eye = a.inverse() * b;
+  return true;
+}
+
 }
 
-void Triangle::raster(std::vector<Pixel> &pixels, int w, int h) const
+void Model::transform_vertices(size_t shape, const Eigen::Matrix4f &modelView,
+                               const Eigen::Matrix4f &projection)
 {
-  int x[2] = {99999, -99999};
-  int y[2] = {99999, -99999};
-  int xd[3];
-  int yd[3];
+  TransformedVertices<float> &tv = m_transformed[shape];
+  if ( tv.valid && tv.modelView == modelView && tv.projection == projection )
+    return;
 
-  // find discrete coordinates of each vertex in 2D plane
-  for ( size_t i=0; i < 3; i++ )
+  const SoAVertices &soa = m_soa[shape];
+  const size_t batches = soa.padded / SOA_WIDTH;
+  if ( !tv.valid || tv.modelView.topLeftCorner<3, 3>() != modelView.topLeftCorner<3, 3>() )
   {
-    xd[i] = int((vertices[i].x() + 1.0f) / 2.0f * w);
-    yd[i] = int((vertices[i].y() + 1.0f) / 2.0f * h);
+    // normals are directions and skip the translation and the projection
+    const Eigen::Matrix3d linear = modelView.topLeftCorner<3, 3>().cast<double>();
+    tv.normalMatrix = linear.inverse().transpose().cast<float>();
+    tv.normalsValid.assign(batches, 0);
   }
-  for ( size_t i=0; i < 3; i++ )
+  if ( !tv.valid || tv.modelView != modelView )
+    tv.positionsValid.assign(batches, 0);
+
+  tv.positions.resize(soa.count);
+  tv.viewPositions.resize(soa.count);
+  tv.normals.resize(soa.count);
+  tv.clipCodes.resize(soa.count);
+  tv.batches.assign(batches, BATCH_PENDING);
+  tv.hasEye = findEye(projection.cast<double>() * modelView.cast<double>(), tv.eye);
+  tv.modelView = modelView;
+  tv.projection = projection;
+  tv.valid = true;
+}
+
+void Model::transform_vertices(size_t shape, const Eigen::Matrix4d &modelView,
+                               const Eigen::Matrix4d &projection)
+{
+  TransformedVertices<double> &tv = m_transformedDouble[shape];
+  if ( tv.valid && tv.modelView == modelView && tv.projection == projection )
+    return;
+
+  const size_t n = m_shapes[shape].mesh.positions.size() / 3;
+  const size_t batches = (n + SOA_WIDTH - 1) / SOA_WIDTH;
+  if ( !tv.valid || tv.modelView.topLeftCorner<3, 3>() != modelView.topLeftCorner<3, 3>() )
   {
-    x[0] = std::min(x[0], xd[i]);
-    x[1] = std::max(x[1], xd[i]);
-    y[0] = std::min(y[0], yd[i]);
-    y[1] = std::max(y[1], yd[i]);
+    const Eigen::Matrix3d linear = modelView.topLeftCorner<3, 3>();
+    tv.normalMatrix = linear.inverse().transpose();
+    tv.normalsValid.assign(batches, 0);
   }
+  if ( !tv.valid || tv.modelView != modelView )
+    tv.positionsValid.assign(batches, 0);
+
+  tv.positions.resize(n);
+  tv.viewPositions.resize(n);
+  tv.normals.resize(n);
+  tv.clipCodes.resize(n);
+  tv.batches.assign(batches, BATCH_PENDING);
+  tv.hasEye = findEye(projection * modelView, tv.eye);
+  tv.modelView = modelView;
+  tv.projection = projection;
+  tv.valid = true;
+}
+
+template <typename Scalar>
+uint8_t Model::clip_code(Scalar x, Scalar y, Scalar z, Scalar w)
+{
+  // the planes of the viewing volume are -w <= x, y, z <= w in clip space,
+  // which holds before the division by w, and behind the viewer too
+  const Scalar guard = GUARD_BAND * w;
+  uint8_t code = 0;
+  if ( x < -w ) code |= CLIP_LEFT;
+  if ( x > w ) code |= CLIP_RIGHT;
+  if ( y < -w ) code |= CLIP_BOTTOM;
+  if ( y > w ) code |= CLIP_TOP;
+  if ( z < -w || w <= 0 ) code |= CLIP_NEAR;
+  if ( z > w ) code |= CLIP_FAR;
+  if ( x < -guard || x > guard || y < -guard || y > guard )
+    code |= CLIP_GUARD_BAND;
+  return code;
+}
+
+void Model::transform_batch(size_t shape, size_t b, GeometryStats &stats, float)
+{
+  static const RasterSIMD::Level simd = RasterSIMD::detect();
 
-  // construct maxtrix A
-  Matrix3 A(Matrix3::Ones());
+  TransformedVertices<float> &tv = m_transformed[shape];
+  float mv[12];
+  float nm[12];
+  float p[16];
+  for ( size_t r=0; r < 3; r++ )
+    for ( size_t c=0; c < 4; c++ )
+    {
+      mv[4*r+c] = tv.modelView(r, c);
+      nm[4*r+c] = c < 3 ? tv.normalMatrix(r, c) : 0.0f;
+    }
+  for ( size_t r=0; r < 4; r++ )
+    for ( size_t c=0; c < 4; c++ )
+      p[4*r+c] = tv.projection(r, c);
+
+  // positions to view space and on to clip space, normals to view space;
+  // what is still valid from an earlier frame is kept
+  const SoAVertices &soa = m_soa[shape];
+  const size_t first = b * SOA_WIDTH;
+  const size_t n = std::min(SOA_WIDTH, soa.count - first);
+  const bool keep_positions = tv.positionsValid[b];
+  const bool keep_normals = tv.normalsValid[b];
+  float scratch[10 * SOA_WIDTH];
+  float *out[10];
+  for ( size_t k=0; k < 10; k++ )
+    out[k] = scratch + k * SOA_WIDTH;
+  float **view = out;
+  float **clip = out + 3;
+  float **normal = out + 7;
+  if ( keep_positions )
+  {
+    for ( size_t i=0; i < SOA_WIDTH; i++ )
+      for ( size_t k=0; k < 3; k++ )
+        view[k][i] = i < n ? tv.viewPositions[first+i](k) : 0.0f;
+  }
+  else
+  {
+    RasterSIMD::transformAffine(simd, mv, soa.plane(0) + first, soa.plane(1) + first,
+                                soa.plane(2) + first, SOA_WIDTH, view);
+  }
+  RasterSIMD::transform(simd, p, view[0], view[1], view[2], SOA_WIDTH, clip);
+  if ( !keep_normals )
+    RasterSIMD::transformAffine(simd, nm, soa.plane(3) + first, soa.plane(4) + first,
+                                soa.plane(5) + first, SOA_WIDTH, normal);
+
+  for ( size_t i=0; i < n; i++ )
+  {
+    const float w = clip[3][i];
+    tv.positions[first+i] = Vector3(clip[0][i] / w, clip[1][i] / w, clip[2][i] / w);
+    tv.clipCodes[first+i] = clip_code(clip[0][i], clip[1][i], clip[2][i], w);
+
+    if ( !keep_positions )
+      tv.viewPositions[first+i] = Vector3(view[0][i], view[1][i], view[2][i]);
+    if ( !keep_normals )
+      tv.normals[first+i] = Vector3(normal[0][i], normal[1][i], normal[2][i]).normalized();
+  }
+
+  stats.vertices += n;
+  stats.positionsReused += keep_positions ? n : 0;
+  stats.normalsReused += keep_normals ? n : 0;
+  tv.positionsValid[b] = 1;
+  tv.normalsValid[b] = 1;
+  tv.batches[b] = BATCH_READY;
+}
+
+void Model::transform_batch(size_t shape, size_t b, GeometryStats &stats, double)
+{
+  TransformedVertices<double> &tv = m_transformedDouble[shape];
+  const std::vector<float> & positions = m_shapes[shape].mesh.positions;
+  const std::vector<float> & normals = m_shapes[shape].mesh.normals;
+  const size_t first = b * SOA_WIDTH;
+  const size_t end = std::min(first + SOA_WIDTH, positions.size() / 3);
+  const bool keep_positions = tv.positionsValid[b];
+  const bool keep_normals = tv.normalsValid[b];
+
+  // the reference path, one vertex at a time in double precision
+  for ( size_t i=first; i < end; i++ )
+  {
+    if ( !keep_positions )
+      tv.viewPositions[i] = (tv.modelView
+        * Eigen::Vector4d(positions[3*i], positions[3*i+1], positions[3*i+2], 1.0)).head<3>();
+    const Eigen::Vector4d v = tv.projection * tv.viewPositions[i].homogeneous();
+    tv.positions[i] = v.head<3>() / v.w();
+    tv.clipCodes[i] = clip_code(v.x(), v.y(), v.z(), v.w());
+
+    if ( !keep_normals )
+      tv.normals[i] = (tv.normalMatrix
+        * Eigen::Vector3d(normals[3*i], normals[3*i+1], normals[3*i+2])).normalized();
+  }
+
+  stats.vertices += end - first;
+  stats.positionsReused += keep_positions ? end - first : 0;
+  stats.normalsReused += keep_normals ? end - first : 0;
+  tv.positionsValid[b] = 1;
+  tv.normalsValid[b] = 1;
+  tv.batches[b] = BATCH_READY;
+}
+
+namespace {
+
+/// Vertex of a polygon being clipped
+template <typename Scalar>
+struct ClipVertex {
+  typename EigenTypesT<Scalar>::Vector4 clip;
+  typename EigenTypesT<Scalar>::Vector3 view;
+  typename EigenTypesT<Scalar>::Vector3 normal;
+};
+
+/// Clip planes: the near plane, then the sides of the guard band
+enum ClipPlane {
+  PLANE_NEAR,
+  PLANE_GUARD_LEFT,
+  PLANE_GUARD_RIGHT,
+  PLANE_GUARD_BOTTOM,
+  PLANE_GUARD_TOP,
+  PLANE_COUNT
+};
+
+/** \brief Signed distance of clip space point v to plane p, scaled by
+ * w, positive on the inner side.
+ */
+template <typename Scalar>
+Scalar clipDistance(const typename EigenTypesT<Scalar>::Vector4 &v, int p)
+{
+  const Scalar guard = Model::GUARD_BAND * v.w();
+  switch ( p ) {
+    case PLANE_NEAR:         return v.z() + v.w();
+    case PLANE_GUARD_LEFT:   return guard + v.x();
+    case PLANE_GUARD_RIGHT:  return guard - v.x();
+    case PLANE_GUARD_BOTTOM: return guard + v.y();
+    default:                 return guard - v.y();
+  }
+}
+
+/** \brief Sutherland-Hodgman: clip the convex polygon in[0..n) to plane
+ * p into out, which gains at most one vertex, and return its size.
+ */
+template <typename Scalar>
+size_t clipPolygon(const ClipVertex<Scalar> *in, size_t n, int p, ClipVertex<Scalar> *out)
+{
+  size_t m = 0;
+  for ( size_t i=0; i < n; i++ )
+  {
+    const ClipVertex<Scalar> &a = in[i];
+    const ClipVertex<Scalar> &b = in[(i+1) % n];
+    const Scalar da = clipDistance<Scalar>(a.clip, p);
+    const Scalar db = clipDistance<Scalar>(b.clip, p);
+    if ( da >= 0 )
+      out[m++] = a;
+    if ( (da >= 0) != (db >= 0) )
+    {
+      // the attributes are linear in clip space, so is the interpolation
+      const Scalar s = da / (da - db);
+      ClipVertex<Scalar> &v = out[m++];
+      v.clip = a.clip + s * (b.clip - a.clip);
+      v.view = a.view + s * (b.view - a.view);
+      v.normal = (a.normal + s * (b.normal - a.normal)).normalized();
+    }
+  }
+  return m;
+}
+
+}
+
+template <typename Scalar>
+void Model::assemble_triangle(FrameVector<TriangleT<Scalar> > &out, size_t shape, size_t j,
+                              CullMode cull, GeometryStats &stats) const
+{
+  typedef typename EigenTypesT<Scalar>::Vector3 Vector3;
+  const std::vector<unsigned int> & indices = m_shapes[shape].mesh.indices;
+  const TransformedVertices<Scalar> &tv = transformed(shape, Scalar());
+  const unsigned int i0 = indices[j], i1 = indices[j+1], i2 = indices[j+2];
+
+  stats.assembled++;
+
+  // filter out this triangle if all three vertices are outside of the
+  // same plane of the viewing volume
+  const uint8_t codes[3] = {tv.clipCodes[i0], tv.clipCodes[i1], tv.clipCodes[i2]};
+  if ( codes[0] & codes[1] & codes[2] & CLIP_FRUSTUM )
+  {
+    stats.outside++;
+    return;
+  }
+
+  // filter out a triangle by the sign of its area on screen, positive if
+  // the front face is seen; all w are positive by now
+  const auto culled = [&](const TriangleT<Scalar> &t) -> bool {
+    if ( cull == CULL_NONE )
+      return false;
+    const Vector3 a = t.vertices[1] - t.vertices[0];
+    const Vector3 b = t.vertices[2] - t.vertices[0];
+    Scalar area = a.x()*b.y() - a.y()*b.x();
+    if ( m_winding[shape] == WINDING_CW )
+      area = -area;
+    return cull == CULL_BACK ? area <= 0 : area >= 0;
+  };
+
+  const uint8_t any = codes[0] | codes[1] | codes[2];
+  if ( !(any & (CLIP_NEAR | CLIP_GUARD_BAND)) )
+  {
+    TriangleT<Scalar> t;
+    for ( size_t k=0; k < 3; k++ )
+      t.vertices[k] = tv.positions[indices[j+k]];
+    if ( culled(t) )
+    {
+      stats.culled++;
+      return;
+    }
+
+    for ( size_t k=0; k < 3; k++ )
+      t.viewPositions[k] = tv.viewPositions[indices[j+k]];
+    for ( size_t k=0; k < 3; k++ )
+      t.normals[k] = tv.normals[indices[j+k]];
+    out.push_back(t);
+    return;
+  }
+
+  // clip in clip space, where the vertices behind the viewer are still
+  // where they belong, against the near plane and the guard band only as
+  // needed; every plane adds at most one vertex
+  stats.clipped++;
+  ClipVertex<Scalar> polygon[2][3 + PLANE_COUNT];
+  for ( size_t k=0; k < 3; k++ )
+  {
+    ClipVertex<Scalar> &v = polygon[0][k];
+    v.view = tv.viewPositions[indices[j+k]];
+    v.clip = tv.projection * v.view.homogeneous();
+    v.normal = tv.normals[indices[j+k]];
+  }
+  size_t n = 3;
+  int current = 0;
+  for ( int p=0; p < PLANE_COUNT && n >= 3; p++ )
+  {
+    if ( !(any & (p == PLANE_NEAR ? CLIP_NEAR : CLIP_GUARD_BAND)) )
+      continue;
+    n = clipPolygon(polygon[current], n, p, polygon[1-current]);
+    current = 1 - current;
+  }
+
+  if ( n < 3 )
+  {
+    stats.outside++;
+    return;
+  }
+
+  // a fan of triangles, facing all the same way as the polygon is planar;
+  // only slivers at the clipped edges may come out degenerate
+  const ClipVertex<Scalar> *v = polygon[current];
+  const size_t size = out.size();
+  for ( size_t k=2; k < n; k++ )
+  {
+    TriangleT<Scalar> t;
+    const ClipVertex<Scalar> *fan[3] = {&v[0], &v[k-1], &v[k]};
+    for ( size_t l=0; l < 3; l++ )
+    {
+      t.vertices[l] = fan[l]->clip.template head<3>() / fan[l]->clip.w();
+      t.viewPositions[l] = fan[l]->view;
+      t.normals[l] = fan[l]->normal;
+    }
+    if ( !culled(t) )
+      out.push_back(t);
+  }
+  if ( out.size() == size )
+    stats.culled++;
+}
+
+namespace {
+
+/** \brief Visitor appending each rastered pixel to a vector.
+ */
+template <typename Scalar>
+struct PixelCollector {
+  std::vector<PixelT<Scalar> > &pixels;
+
+  PixelCollector(std::vector<PixelT<Scalar> > &pixels)
+    : pixels(pixels)
+  {}
+
+  void operator()(int x, int y, const typename EigenTypesT<Scalar>::Vector3 &t)
+  {
+    pixels.push_back(PixelT<Scalar>(x, y, t));
+  }
+};
+
+}
+
+const char *TriangleBase::rasterModeName(RasterMode mode)
+{
+  switch ( mode )
+  {
+    case RASTER_BARYCENTRIC:
+      return "barycentric";
+    case RASTER_EDGE_FUNCTION:
+      return "edge function";
+    case RASTER_HIERARCHICAL:
+      return "hierarchical";
+  }
+  return "unknown";
+}
+
+template <typename Scalar>
+void TriangleT<Scalar>::raster(std::vector<Pixel> &pixels, int w, int h, RasterMode mode) const
+{
+  PixelCollector<Scalar> collector(pixels);
+  raster(collector, w, h, mode);
+}
+
+namespace {
+
+/// floor(n / d) for d > 0
+inline int floorDiv(int n, int d)
+{
+  return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+/// First pixel whose center lies at or after sub-pixel coordinate v
+inline int firstPixel(int v)
+{
+  return floorDiv(v + TriangleBase::SUBPIXEL_SCALE / 2 - 1, TriangleBase::SUBPIXEL_SCALE);
+}
+
+/// Last pixel whose center lies at or before sub-pixel coordinate v
+inline int lastPixel(int v)
+{
+  return floorDiv(v - TriangleBase::SUBPIXEL_SCALE / 2, TriangleBase::SUBPIXEL_SCALE);
+}
+
+}
+
+template <typename Scalar>
+void TriangleT<Scalar>::snap(int xd[3], int yd[3], int w, int h) const
+{
+  // round to the nearest sub-pixel
   for ( size_t i=0; i < 3; i++ )
   {
-    A(0, i) = xd[i];
-    A(1, i) = yd[i];
+    xd[i] = int(std::floor((vertices[i].x() + 1.0f) * (w * SUBPIXEL_SCALE / 2) + 0.5f));
+    yd[i] = int(std::floor((vertices[i].y() + 1.0f) * (h * SUBPIXEL_SCALE / 2) + 0.5f));
   }
-  A = A.inverse().eval();
+}
+
+template <typename Scalar>
+PixelRect TriangleT<Scalar>::bounds(int w, int h) const
+{
+  int xd[3];
+  int yd[3];
+
+  snap(xd, yd, w, h);
+  return bounds(xd, yd);
+}
+
+template <typename Scalar>
+PixelRect TriangleT<Scalar>::bounds(const int xd[3], const int yd[3])
+{
+  return PixelRect(firstPixel(std::min(xd[0], std::min(xd[1], xd[2]))),
+                   firstPixel(std::min(yd[0], std::min(yd[1], yd[2]))),
+                   lastPixel(std::max(xd[0], std::max(xd[1], xd[2]))),
+                   lastPixel(std::max(yd[0], std::max(yd[1], yd[2]))));
+}
+
+template <typename Scalar>
+bool TriangleT<Scalar>::setupEdges(EdgeFunctions &edges, int w, int h) const
+{
+  int xd[3];
+  int yd[3];
+
+  snap(xd, yd, w, h);
+  return setupEdges(edges, xd, yd);
+}
+
+template <typename Scalar>
+bool TriangleT<Scalar>::setupEdges(EdgeFunctions &edges, const int xd[3], const int yd[3])
+{
+  edges.bounds = bounds(xd, yd);
 
-  // find each pixel
-  for ( int i=x[0]; i <= x[1]; i++ )
-    for ( int j=y[0]; j <= y[1]; j++ )
+  // edge function k vanishes on the edge from vertex k+1 to vertex k+2;
+  // in sub-pixels it is A x + B y + C, and pixel (x, y) is sampled at
+  // (x * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2, ...)
+  for ( size_t k=0; k < 3; k++ )
+  {
+    const size_t k1 = (k+1) % 3;
+    const size_t k2 = (k+2) % 3;
+    const int64_t a = int64_t(yd[k1]) - yd[k2];
+    const int64_t b = int64_t(xd[k2]) - xd[k1];
+    const int64_t c = -(a * xd[k1] + b * yd[k1]);
+    edges.a[k] = a * SUBPIXEL_SCALE;
+    edges.b[k] = b * SUBPIXEL_SCALE;
+    edges.c[k] = c + (a + b) * (SUBPIXEL_SCALE / 2);
+  }
+
+  edges.area = (int64_t(yd[1]) - yd[2]) * (int64_t(xd[0]) - xd[1])
+             + (int64_t(xd[2]) - xd[1]) * (int64_t(yd[0]) - yd[1]);
+  if ( edges.area == 0 )
+    return false;
+
+  // make the edge functions non-negative inside the triangle
+  if ( edges.area < 0 )
+  {
+    for ( size_t k=0; k < 3; k++ )
     {
-      Vector3 b(i, j, 1.0);
-      Vector3 t = A * b;
+      edges.a[k] = -edges.a[k];
+      edges.b[k] = -edges.b[k];
+      edges.c[k] = -edges.c[k];
+    }
+    edges.area = -edges.area;
+  }
 
-      if ( t.x() < 0 || t.y() < 0 || t.z() < 0 )
-        continue;
+  // top-left rule: centers on a left edge, with the inside to the right,
+  // or a top edge, with the inside below, count as inside; on any other
+  // edge they are pushed out. Rows go up, so below means b < 0.
+  for ( size_t k=0; k < 3; k++ )
+    if ( !(edges.a[k] > 0 || (edges.a[k] == 0 && edges.b[k] < 0)) )
+      edges.c[k]--;
+  return true;
+}
+
+template <typename Scalar>
+int TriangleT<Scalar>::sampleMicro(const int xd[3], const int yd[3],
+                                   int x[2], int y[2], Vector3 t[2])
+{
+  EdgeFunctions edges;
+  if ( !setupEdges(edges, xd, yd) )
+    return 0;
 
-      pixels.push_back(Pixel(i, j, t));
+  const PixelRect &r = edges.bounds;
+  ASSERT(r.x1 - r.x0 + r.y1 - r.y0 <= 1);
+  const Scalar inv_area = Scalar(1) / edges.area;
+  int n = 0;
+  for ( int j=r.y0; j <= r.y1; j++ )
+    for ( int i=r.x0; i <= r.x1; i++ )
+    {
+      const int64_t e0 = edges.at(0, i, j);
+      const int64_t e1 = edges.at(1, i, j);
+      const int64_t e2 = edges.at(2, i, j);
+      if ( (e0 | e1 | e2) < 0 )
+        continue;
+      x[n] = i;
+      y[n] = j;
+      t[n] = Vector3(e0*inv_area, e1*inv_area, e2*inv_area);
+      n++;
     }
+  return n;
+}
+
+template <typename Scalar>
+float TriangleT<Scalar>::getDepth(const Pixel &p) const
+{
+  return getDepth(p.t);
 }
 
-float Triangle::getDepth(const Pixel &p) const
+template <typename Scalar>
+float TriangleT<Scalar>::getDepth(const Vector3 &t) const
 {
-  const Vector3 &t = p.t;
+  return float(t.x()*vertices[0].z()
+             + t.y()*vertices[1].z()
+             + t.z()*vertices[2].z());
+}
 
-  return t.x()*vertices[0].z()
-       + t.y()*vertices[1].z()
-       + t.z()*vertices[2].z();
+template <typename Scalar>
+uint32_t TriangleT<Scalar>::getColor(const Pixel &p) const
+{
+  return getColor(p.t);
 }
 
-uint32_t Triangle::getColor(const Pixel &p) const
+template <typename Scalar>
+uint32_t TriangleT<Scalar>::getColor(const Vector3 &t) const
 {
 #if 0
-  int t = 255 * (0.5*getDepth(p)+0.5);
-  return (0xff000000 | t << 16 | t << 8 | t);
+  int d = 255 * (0.5*getDepth(t)+0.5);
+  return (0xff000000 | d << 16 | d << 8 | d);
 #endif
 
   // define static material color
-  const static float shininess = 15.0f;
-  const static Vector3 diffuse(0.929524f, 0.796542f, 0.178823f);
-  const static Vector3 specular(1.00000f, 0.980392f, 0.549020f);
+  const static Vector3 diffuse(DIFFUSE[0], DIFFUSE[1], DIFFUSE[2]);
+  const static Vector3 specular(SPECULAR[0], SPECULAR[1], SPECULAR[2]);
 
-  // calculate position and normal for p
-  const Vector3 &t = p.t;
-  Vector3 v = t.x()*vertices[0] + t.y()*vertices[1] + t.z()*vertices[2];
+  // calculate position and normal for p, in view space
+  Vector3 v = t.x()*viewPositions[0] + t.y()*viewPositions[1] + t.z()*viewPositions[2];
   Vector3 n = t.x()*normals[0] + t.y()*normals[1] + t.z()*normals[2];
   n.normalize();
 
-  const Vector3 light_position = Vector3(0.0, 5.0, 0.0);
+  const Vector3 light_position(LIGHT_POSITION[0], LIGHT_POSITION[1], LIGHT_POSITION[2]);
 
   // calculate light vector, view vector and half vector
   Vector3 li = (light_position-v).normalized();
@@ -315,17 +1371,43 @@ uint32_t Triangle::getColor(const Pixel &p) const
   Vector3 h = (li+vi).normalized();
 
   // calculate color using phong model
-  Vector3 color = 0.3*diffuse;
+  Vector3 color = Scalar(0.3)*diffuse;
   if ( n.dot(li) > 0 )
     color += diffuse * (n.dot(li));
   if ( n.dot(h) >= 0 )
-    color += specular * std::pow((double)n.dot(h), (double)shininess);
-  color(0) = std::max(color(0), 0.0); color(0) = std::min(color(0), 1.0);
-  color(1) = std::max(color(1), 0.0); color(1) = std::min(color(1), 1.0);
-  color(2) = std::max(color(2), 0.0); color(2) = std::min(color(2), 1.0);
+    color += specular * std::pow(n.dot(h), Scalar(SHININESS));
+  color(0) = std::max(color(0), Scalar(0)); color(0) = std::min(color(0), Scalar(1));
+  color(1) = std::max(color(1), Scalar(0)); color(1) = std::min(color(1), Scalar(1));
+  color(2) = std::max(color(2), Scalar(0)); color(2) = std::min(color(2), Scalar(1));
 
   int r = 255 * color.x();
   int g = 255 * color.y();
   int b = 255 * color.z();
   return (0xff000000 | r << 16 | g << 8 | b);
 }
+
+template struct TriangleT<float>;
+template struct TriangleT<double>;
+
+template void Model::getTriangles<float>(FrameVector<TriangleT<float> > &,
+                                         const EigenTypesT<float>::Matrix4 &,
+                                         const EigenTypesT<float>::Matrix4 &,
+                                         Model::CullMode, Model::GeometryStats &,
+                                         ThreadPool *);
+template void Model::getTriangles<double>(FrameVector<TriangleT<double> > &,
+                                          const EigenTypesT<double>::Matrix4 &,
+                                          const EigenTypesT<double>::Matrix4 &,
+                                          Model::CullMode, Model::GeometryStats &,
+                                          ThreadPool *);
+template void Model::getTriangles<float>(FrameVector<TriangleT<float> > &,
+                                         const EigenTypesT<float>::Matrix4 &,
+                                         const EigenTypesT<float>::Matrix4 &,
+                                         const FrameVector<Model::NodeRef> &,
+                                         Model::CullMode, Model::GeometryStats &,
+                                         ThreadPool *);
+template void Model::getTriangles<double>(FrameVector<TriangleT<double> > &,
+                                          const EigenTypesT<double>::Matrix4 &,
+                                          const EigenTypesT<double>::Matrix4 &,
+                                          const FrameVector<Model::NodeRef> &,
+                                          Model::CullMode, Model::GeometryStats &,
+                                          ThreadPool *);
@@ -3,39 +3,307 @@
 
 #include <string>
 #include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
 #include <Eigen/Eigen>
 #include <stdint.h>
 #include "tiny_obj_loader.h"
+#include "AlignedArray.hpp"
+#include "ThreadPool.hpp"
+#include "FrameArena.hpp"
 #include "Logger.hpp"
 
-struct EigenTypes {
-  typedef Eigen::Vector3d Vector3;
-  typedef Eigen::Vector4d Vector4;
-  typedef Eigen::Matrix3d Matrix3;
-  typedef Eigen::Matrix4d Matrix4;
+template <typename Scalar>
+struct EigenTypesT {
+  typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+  typedef Eigen::Matrix<Scalar, 4, 1> Vector4;
+  typedef Eigen::Matrix<Scalar, 3, 3> Matrix3;
+  typedef Eigen::Matrix<Scalar, 4, 4> Matrix4;
 };
 
-struct Pixel : public EigenTypes {
+/// The pipeline runs in single precision, double is kept for reference
+typedef EigenTypesT<float> EigenTypes;
+
+template <typename Scalar>
+struct PixelT : public EigenTypesT<Scalar> {
+  typedef typename EigenTypesT<Scalar>::Vector3 Vector3;
+
   int x, y;  /// image coordinates
   Vector3 t; /// barycentric coordinates
 
-  Pixel(int x, int y, Vector3 t)
+  PixelT(int x, int y, Vector3 t)
     : x(x), y(y), t(t)
   {}
 };
 
-struct Triangle : public EigenTypes
+typedef PixelT<float> Pixel;
+
+/// Inclusive rectangle of pixels
+struct PixelRect {
+  int x0, y0; /// lower left corner
+  int x1, y1; /// upper right corner
+
+  PixelRect()
+    : x0(0), y0(0), x1(-1), y1(-1)
+  {}
+
+  PixelRect(int x0, int y0, int x1, int y1)
+    : x0(x0), y0(y0), x1(x1), y1(y1)
+  {}
+
+  bool empty() const
+  {
+    return x0 > x1 || y0 > y1;
+  }
+
+  PixelRect intersected(const PixelRect &r) const
+  {
+    return PixelRect(std::max(x0, r.x0), std::max(y0, r.y0),
+                     std::min(x1, r.x1), std::min(y1, r.y1));
+  }
+};
+
+/** \brief Integer edge functions of a triangle snapped to sub-pixels.
+ *
+ * Edge function k is opposite to vertex k,
+ *   E_k(x, y) = a[k] * x + b[k] * y + c[k],
+ * evaluated at the center of pixel (x, y) in square sub-pixels. It is
+ * non-negative exactly at the pixels the triangle covers under the
+ * top-left fill rule: a center on a left or a top edge is inside, one on
+ * a right or a bottom edge is not, so a pixel on an edge shared by two
+ * triangles belongs to exactly one of them. E_k / area is the barycentric
+ * coordinate t_k of pixel (x, y), up to the 1 / area the rule subtracts.
+ */
+struct EdgeFunctions {
+  int64_t a[3];     ///< step of E_k for one pixel in x, a multiple of SUBPIXEL_SCALE
+  int64_t b[3];     ///< step of E_k for one row in y, a multiple of SUBPIXEL_SCALE
+  int64_t c[3];     ///< E_k at pixel (0, 0)
+  int64_t area;     ///< twice the area of the triangle in square sub-pixels
+  PixelRect bounds; ///< pixels whose centers lie in the bounding box
+
+  int64_t at(size_t k, int x, int y) const
+  {
+    return a[k] * x + b[k] * y + c[k];
+  }
+};
+
+/// Constants shared by the triangles of any precision
+struct TriangleBase {
+  /// Rasterization algorithms, selectable at runtime for benchmarking
+  enum RasterMode {
+    RASTER_BARYCENTRIC,   ///< invert a 3x3 matrix, multiply it for each pixel
+    RASTER_EDGE_FUNCTION, ///< step three integer edge functions incrementally
+    RASTER_HIERARCHICAL   ///< edge functions, classifying blocks first
+  };
+  static const char *rasterModeName(RasterMode mode);
+
+  /// Block size of RASTER_HIERARCHICAL, a power of two
+  static const int BLOCK_SIZE = 8;
+
+  /// Vertices are snapped to fixed point with this many fractional bits
+  static const int SUBPIXEL_BITS = 8;
+  static const int SUBPIXEL_SCALE = 1 << SUBPIXEL_BITS;
+
+  /// Phong material and light used by getColor(), the light in view space
+  static const int SHININESS = 15;
+  static const float DIFFUSE[3];
+  static const float SPECULAR[3];
+  static const float LIGHT_POSITION[3];
+};
+
+/** \brief Triangle after transformation, with geometry, raster and
+ * shading in precision Scalar.
+ */
+template <typename Scalar>
+struct TriangleT : public TriangleBase, public EigenTypesT<Scalar>
 {
-  Vector3 vertices[3];
-  Vector3 normals[3];
+  typedef typename EigenTypesT<Scalar>::Vector3 Vector3;
+  typedef typename EigenTypesT<Scalar>::Matrix3 Matrix3;
+  typedef PixelT<Scalar> Pixel;
 
-  void raster(std::vector<Pixel> &pixels, int w, int h) const;
+  Vector3 vertices[3];      ///< normalized device coordinates
+  Vector3 viewPositions[3]; ///< view space positions, for lighting
+  Vector3 normals[3];       ///< view space normals, unit length
+
+  /** \brief Raster the triangle into a w*h image.
+   *
+   * visit(x, y, t) is called for each covered pixel as soon as it is
+   * generated, where t holds the barycentric coordinates of (x, y).
+   */
+  template <typename Visitor>
+  void raster(Visitor &visit, int w, int h,
+              RasterMode mode=RASTER_EDGE_FUNCTION) const;
+  /** \brief Raster only the pixels of a w*h image lying inside clip.
+   */
+  template <typename Visitor>
+  void raster(Visitor &visit, int w, int h, const PixelRect &clip,
+              RasterMode mode=RASTER_EDGE_FUNCTION) const;
+  /** \brief Collect all covered pixels, mainly for debugging.
+   */
+  void raster(std::vector<Pixel> &pixels, int w, int h,
+              RasterMode mode=RASTER_EDGE_FUNCTION) const;
+  float getDepth(const Vector3 &t) const;
   float getDepth(const Pixel &p) const;
+  uint32_t getColor(const Vector3 &t) const;
   uint32_t getColor(const Pixel &p) const;
+
+  /** \brief Snap vertices to fixed point coordinates in a w*h image,
+   * with SUBPIXEL_BITS fractional bits.
+   *
+   * Pixel (x, y) is sampled at its center, (x + 1/2, y + 1/2).
+   */
+  void snap(int xd[3], int yd[3], int w, int h) const;
+  /** \brief Pixels whose centers lie in the bounding box of the snapped
+   * vertices, not clipped to the image; empty if there are none.
+   */
+  PixelRect bounds(int w, int h) const;
+  /** \brief bounds() of the vertices snap() gave.
+   */
+  static PixelRect bounds(const int xd[3], const int yd[3]);
+  /** \brief Set up the edge functions in a w*h image.
+   *
+   * Returns false for degenerate triangles, which cover no pixel.
+   */
+  bool setupEdges(EdgeFunctions &edges, int w, int h) const;
+  /** \brief setupEdges() from the vertices snap() gave.
+   */
+  static bool setupEdges(EdgeFunctions &edges, const int xd[3], const int yd[3]);
+  /** \brief Sample a micro triangle, whose bounds hold at most two pixel
+   * centers, at just those centers.
+   *
+   * xd and yd are the vertices snap() gave. The covered pixels and their
+   * barycentric coordinates, the ones RASTER_EDGE_FUNCTION computes, go
+   * to x, y and t, and their number is returned.
+   */
+  static int sampleMicro(const int xd[3], const int yd[3], int x[2], int y[2], Vector3 t[2]);
+
+protected:
+  template <typename Visitor>
+  void rasterBarycentric(Visitor &visit, int w, int h, const PixelRect &clip) const;
+  template <typename Visitor>
+  void rasterEdgeFunction(Visitor &visit, int w, int h, const PixelRect &clip) const;
+  template <typename Visitor>
+  void rasterHierarchical(Visitor &visit, int w, int h, const PixelRect &clip) const;
+};
+
+typedef TriangleT<float> Triangle;
+
+/// Node of a bounding volume hierarchy over the triangles of a shape
+struct BVHNode : public EigenTypes {
+  Vector3 lo, hi;        ///< bounding box in model space
+  uint32_t left, right;  ///< child nodes, both 0 for leaves
+  uint32_t first, count; ///< range of the subtree's triangles in BVH order
+
+  BVHNode()
+    : lo(Vector3::Zero()), hi(Vector3::Zero()),
+      left(0), right(0), first(0), count(0)
+  {}
+
+  bool isLeaf() const
+  {
+    return left == 0;
+  }
+};
+
+/** \brief Cluster of triangles of a shape with a cone bounding their
+ * normals.
+ *
+ * Every triangle of the meshlet faces away from an eye at p if
+ * dot(normalize(apex-p), axis) >= cutoff, so the whole meshlet can be
+ * culled without looking at its triangles.
+ */
+struct Meshlet : public EigenTypes {
+  uint32_t first, count; ///< range of its triangles in BVH order
+  uint32_t firstBatch, batches; ///< range of its vertex batches in the batch list
+  Vector3 apex;          ///< apex of the normal cone
+  Vector3 axis;          ///< axis of the normal cone, unit length
+  float cutoff;          ///< above 1 if the normals span a half space or more
+
+  Meshlet()
+    : first(0), count(0), firstBatch(0), batches(0),
+      apex(Vector3::Zero()), axis(Vector3::Zero()), cutoff(0.0f)
+  {}
+};
+
+/** \brief The six planes of a viewing volume in model space.
+ *
+ * Each plane is a sum or difference of the last and one other row of the
+ * model view projection matrix, as QGLViewer's
+ * Camera::getFrustumPlanesCoefficients computes them, with the inside of
+ * the frustum on the positive side of all six.
+ */
+struct Frustum : public EigenTypesT<double> {
+  enum Test {
+    OUTSIDE,      ///< box entirely outside of some plane
+    INTERSECTING, ///< box may cross the boundary
+    INSIDE        ///< box entirely inside of all planes
+  };
+
+  Vector4 planes[6]; ///< (a, b, c, d) with a*x+b*y+c*z+d >= 0 inside
+
+  explicit Frustum(const Matrix4 &transform);
+
+  /** \brief Where the bounding box of node lies.
+   */
+  Test test(const BVHNode &node) const;
 };
 
 class Model : public EigenTypes {
 public:
+  /// Maximum number of triangles in a BVH leaf
+  static const size_t BVH_LEAF_SIZE = 64;
+  /// Maximum numbers of vertices and triangles in a meshlet
+  static const size_t MESHLET_VERTICES = 32;
+  static const size_t MESHLET_TRIANGLES = 32;
+  /// Chunks per thread of the parallel geometry stage, for load balance
+  static const size_t GEOMETRY_CHUNKS = 4;
+
+  /// A node, or a meshlet, of a shape: the shape's index, then its own
+  typedef std::pair<uint32_t, uint32_t> NodeRef;
+  /// Vertex arrays are padded to a multiple of this many vertices
+  static const size_t SOA_WIDTH = 8;
+  /// Half extent of the guard band in normalized device coordinates;
+  /// only triangles reaching beyond it are clipped at its sides
+  static const int GUARD_BAND = 64;
+
+  enum CullMode {
+    CULL_NONE,  ///< keep triangles facing either way
+    CULL_BACK,  ///< drop triangles facing away from the viewer
+    CULL_FRONT  ///< drop triangles facing the viewer
+  };
+  static const char *cullModeName(CullMode mode);
+
+  /// Order of the vertices of front faces, seen from outside
+  enum Winding {
+    WINDING_CCW, ///< counter-clockwise, as OBJ files should be
+    WINDING_CW   ///< clockwise
+  };
+  static const char *windingName(Winding winding);
+
+  /// Triangle counts of the geometry stage, summed over getTriangles calls
+  struct GeometryStats {
+    size_t nodesTested; ///< BVH nodes tested against the view frustum
+    size_t nodesCulled; ///< BVH nodes found outside of it
+    size_t skipped;     ///< triangles below those nodes, never assembled
+    size_t meshletsTested; ///< meshlets tested against their normal cone
+    size_t meshletsCulled; ///< meshlets found facing away
+    size_t coneSkipped;    ///< triangles of those meshlets, never assembled
+    size_t vertices;    ///< vertices transformed
+    size_t normalsReused;   ///< of those, with normals kept from an earlier frame
+    size_t positionsReused; ///< of those, with view positions kept from an earlier frame
+    size_t assembled;   ///< triangles read from the shapes
+    size_t outside;     ///< dropped as outside of the viewing volume
+    size_t clipped;     ///< clipped at the near plane or the guard band
+    size_t culled;      ///< dropped by the cull mode
+
+    GeometryStats()
+      : nodesTested(0), nodesCulled(0), skipped(0),
+        meshletsTested(0), meshletsCulled(0), coneSkipped(0), vertices(0),
+        normalsReused(0), positionsReused(0), assembled(0), outside(0),
+        clipped(0), culled(0)
+    {}
+  };
 
 public:
   Model(const char *filename);
@@ -51,17 +319,343 @@ public:
   void *normalData(size_t i);
   void *indexData(size_t i);
 
-  void getTriangles(std::vector<Triangle> &triangles, const Matrix4 &transform);
+  /** \brief Winding of the front faces of shape i.
+   *
+   * Guessed on loading, from the normals of the file if it has any and
+   * from the sign of the enclosed volume otherwise.
+   */
+  Winding winding(size_t i) const;
+  void setWinding(size_t i, Winding winding);
+
+  /** \brief Transform and filter the triangles of all shapes.
+   *
+   * modelView takes the vertices to view space, where they are lit, and
+   * projection from there to clip space. Normals are transformed by the
+   * inverse transpose of the upper 3x3 of modelView only. BVH subtrees
+   * outside of the view frustum are skipped whole, and so are meshlets
+   * facing away if cull is CULL_BACK. Only the vertices of the remaining
+   * triangles are transformed. Triangles outside of the viewing volume
+   * are dropped, and so are the ones cull drops by the signed area of
+   * their projection. Triangles crossing the near plane are clipped to
+   * it in clip space, before the division by w, and so are the few
+   * reaching beyond the guard band to its sides; all others are left for
+   * the raster stage to clamp to the viewport. The counts are added to
+   * stats. Instantiated for float and double.
+   *
+   * With a pool, vertices and triangles are processed in parallel, each
+   * chunk into its own buffer, and appended in the order of a serial
+   * run. Work lists and buffers come from the arena of triangles'
+   * allocator, if it has one.
+   */
+  template <typename Scalar>
+  void getTriangles(FrameVector<TriangleT<Scalar> > &triangles,
+                    const typename EigenTypesT<Scalar>::Matrix4 &modelView,
+                    const typename EigenTypesT<Scalar>::Matrix4 &projection,
+                    CullMode cull, GeometryStats &stats, ThreadPool *pool=0);
+  /** \brief Transform and filter the triangles below a list of BVH nodes,
+   * in the order of the list.
+   */
+  template <typename Scalar>
+  void getTriangles(FrameVector<TriangleT<Scalar> > &triangles,
+                    const typename EigenTypesT<Scalar>::Matrix4 &modelView,
+                    const typename EigenTypesT<Scalar>::Matrix4 &projection,
+                    const FrameVector<NodeRef> &nodes,
+                    CullMode cull, GeometryStats &stats, ThreadPool *pool=0);
+
+  /** \brief BVH of shape i, with the root first.
+   */
+  const std::vector<BVHNode> &bvh(size_t i) const;
 
 protected:
   /** \brief Calculate normals for each vertex.
    */
   void calculate_normal(size_t idx);
+  /** \brief Guess the winding of a shape; has_normals tells whether
+   * its normals came from the file.
+   */
+  Winding detect_winding(size_t idx, bool has_normals) const;
+  /** \brief Build the BVH by median splits of triangle centroids.
+   */
+  void build_bvh(size_t idx);
+  /** \brief Renumber the vertices of a shape in order of first use by
+   * its BVH leaves, so that the vertices of a subtree share few batches.
+   */
+  void reorder_vertices(size_t idx);
+  /** \brief Split each BVH leaf of a shape into meshlets of at most
+   * MESHLET_VERTICES vertices and MESHLET_TRIANGLES triangles.
+   */
+  void build_meshlets(size_t idx);
+  /** \brief Copy the vertices of a shape into m_soa.
+   */
+  void build_soa(size_t idx);
+  /** \brief Set up the vertex cache of a shape for a model view and a
+   * projection matrix, unless it already is; batches of vertices are then
+   * transformed as needed.
+   *
+   * View space normals are kept if the upper 3x3 of modelView is the same
+   * as before, as when the camera only zooms, and view space positions if
+   * modelView is, as when only the projection changes.
+   */
+  void transform_vertices(size_t shape, const Eigen::Matrix4f &modelView,
+                          const Eigen::Matrix4f &projection);
+  void transform_vertices(size_t shape, const Eigen::Matrix4d &modelView,
+                          const Eigen::Matrix4d &projection);
+  /** \brief Transform batch b of SOA_WIDTH vertices of a shape, adding
+   * its vertices to stats. Distinct batches may be transformed
+   * concurrently.
+   *
+   * Single precision runs the SIMD kernel over m_soa, double precision
+   * transforms the mesh one vertex at a time.
+   */
+  void transform_batch(size_t shape, size_t b, GeometryStats &stats, float);
+  void transform_batch(size_t shape, size_t b, GeometryStats &stats, double);
+  /** \brief Assemble triangle j/3 of a shape from its transformed
+   * vertices and append to out what is left of it after clipping and
+   * culling: nothing, the triangle, or a fan of clipped triangles.
+   */
+  template <typename Scalar>
+  void assemble_triangle(FrameVector<TriangleT<Scalar> > &out, size_t shape, size_t j,
+                         CullMode cull, GeometryStats &stats) const;
+  /** \brief ClipCode bits of a vertex in clip space.
+   */
+  template <typename Scalar>
+  static uint8_t clip_code(Scalar x, Scalar y, Scalar z, Scalar w);
+
+protected:
+  /// Aligned structure-of-arrays copy of the vertices of a shape
+  struct SoAVertices {
+    size_t count;  ///< number of vertices
+    size_t padded; ///< count rounded up to SOA_WIDTH
+    AlignedArray<float> data; ///< planes x, y, z, nx, ny, nz of padded floats
+
+    const float *plane(size_t k) const { return data.data() + k * padded; }
+  };
+
+  /// Planes of the viewing volume a vertex lies outside of
+  enum ClipCode {
+    CLIP_LEFT   = 1 << 0,
+    CLIP_RIGHT  = 1 << 1,
+    CLIP_BOTTOM = 1 << 2,
+    CLIP_TOP    = 1 << 3,
+    CLIP_NEAR   = 1 << 4, ///< also set behind the viewer
+    CLIP_FAR    = 1 << 5,
+    CLIP_GUARD_BAND = 1 << 6, ///< beyond GUARD_BAND in x or y
+    CLIP_FRUSTUM = 0x3f  ///< all planes of the viewing volume
+  };
+
+  enum BatchState {
+    BATCH_PENDING, ///< not needed so far
+    BATCH_QUEUED,  ///< to be transformed
+    BATCH_READY    ///< transformed
+  };
+
+  /// Vertices of a shape after the transformation of the current frame
+  template <typename Scalar>
+  struct TransformedVertices {
+    bool valid;
+    typename EigenTypesT<Scalar>::Matrix4 modelView;
+    typename EigenTypesT<Scalar>::Matrix4 projection;
+    /// inverse transpose of the upper 3x3 of modelView
+    typename EigenTypesT<Scalar>::Matrix3 normalMatrix;
+    bool hasEye;         ///< false for parallel projections
+    Eigen::Vector3d eye; ///< viewer in model space
+    std::vector<typename EigenTypesT<Scalar>::Vector3> positions; ///< normalized device coordinates
+    std::vector<typename EigenTypesT<Scalar>::Vector3> viewPositions;
+    std::vector<typename EigenTypesT<Scalar>::Vector3> normals;   ///< in view space
+    std::vector<uint8_t> clipCodes; ///< ClipCode bits of each vertex
+    std::vector<uint8_t> batches; ///< BatchState of each batch of SOA_WIDTH
+    std::vector<uint8_t> normalsValid;   ///< per batch, normals are up to date
+    std::vector<uint8_t> positionsValid; ///< per batch, viewPositions are up to date
+
+    TransformedVertices()
+      : valid(false), hasEye(false)
+    {}
+  };
+
+  const TransformedVertices<float> &transformed(size_t shape, float) const;
+  const TransformedVertices<double> &transformed(size_t shape, double) const;
+  TransformedVertices<float> &transformed(size_t shape, float);
+  TransformedVertices<double> &transformed(size_t shape, double);
 
 protected:
   std::string m_filename;
   std::vector<tinyobj::shape_t> m_shapes;
-
+  std::vector<Winding> m_winding;
+  std::vector<std::vector<BVHNode> > m_bvh;
+  /// triangle indices of each shape, in the order of the BVH leaves
+  std::vector<std::vector<uint32_t> > m_bvhTriangles;
+  /// meshlets of each shape, in BVH order, none straddling two leaves
+  std::vector<std::vector<Meshlet> > m_meshlets;
+  /// vertex batches of each shape's meshlets, sorted per meshlet
+  std::vector<std::vector<uint32_t> > m_meshletBatches;
+  std::vector<SoAVertices> m_soa;
+  /// post-transform vertex cache of each shape, shared by its triangles
+  std::vector<TransformedVertices<float> > m_transformed;
+  std::vector<TransformedVertices<double> > m_transformedDouble;
 };
 
+template <typename Scalar>
+template <typename Visitor>
+void TriangleT<Scalar>::raster(Visitor &visit, int w, int h, RasterMode mode) const
+{
+  raster(visit, w, h, PixelRect(0, 0, w-1, h-1), mode);
+}
+
+template <typename Scalar>
+template <typename Visitor>
+void TriangleT<Scalar>::raster(Visitor &visit, int w, int h, const PixelRect &clip, RasterMode mode) const
+{
+  switch ( mode )
+  {
+    case RASTER_BARYCENTRIC:
+      rasterBarycentric(visit, w, h, clip);
+      break;
+    case RASTER_EDGE_FUNCTION:
+      rasterEdgeFunction(visit, w, h, clip);
+      break;
+    case RASTER_HIERARCHICAL:
+      rasterHierarchical(visit, w, h, clip);
+      break;
+  }
+}
+
+template <typename Scalar>
+template <typename Visitor>
+void TriangleT<Scalar>::rasterBarycentric(Visitor &visit, int w, int h, const PixelRect &clip) const
+{
+  int xd[3];
+  int yd[3];
+
+  // find discrete coordinates of each vertex in 2D plane
+  snap(xd, yd, w, h);
+  const PixelRect r = bounds(w, h).intersected(clip);
+  if ( r.empty() )
+    return;
+
+  // construct maxtrix A relative to vertex 0, so that its entries are
+  // the size of the triangle rather than of the image, which a float
+  // inverse cannot resolve in sub-pixels
+  Matrix3 A(Matrix3::Ones());
+  for ( size_t i=0; i < 3; i++ )
+  {
+    A(0, i) = xd[i] - xd[0];
+    A(1, i) = yd[i] - yd[0];
+  }
+  A = A.inverse().eval();
+
+  // find each pixel by its center; being floating point, this has no
+  // exact fill rule, and pixels on shared edges may be drawn twice
+  for ( int i=r.x0; i <= r.x1; i++ )
+    for ( int j=r.y0; j <= r.y1; j++ )
+    {
+      Vector3 b(i * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2 - xd[0],
+                j * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2 - yd[0], 1);
+      Vector3 t = A * b;
+
+      if ( t.x() < 0 || t.y() < 0 || t.z() < 0 )
+        continue;
+
+      visit(i, j, t);
+    }
+}
+
+template <typename Scalar>
+template <typename Visitor>
+void TriangleT<Scalar>::rasterEdgeFunction(Visitor &visit, int w, int h, const PixelRect &clip) const
+{
+  EdgeFunctions edges;
+  if ( !setupEdges(edges, w, h) )
+    return;
+
+  const PixelRect r = edges.bounds.intersected(clip);
+  if ( r.empty() )
+    return;
+
+  // stepping one pixel in x adds a[k], stepping one row in y adds b[k]
+  const int64_t *a = edges.a;
+  const int64_t *b = edges.b;
+  int64_t e[3];
+  for ( size_t k=0; k < 3; k++ )
+    e[k] = edges.at(k, r.x0, r.y0);
+  const Scalar inv_area = Scalar(1) / edges.area;
+
+  // find each pixel
+  for ( int j=r.y0; j <= r.y1; j++ )
+  {
+    int64_t e0 = e[0], e1 = e[1], e2 = e[2];
+    for ( int i=r.x0; i <= r.x1; i++ )
+    {
+      if ( (e0 | e1 | e2) >= 0 )
+        visit(i, j, Vector3(e0*inv_area, e1*inv_area, e2*inv_area));
+      e0 += a[0];
+      e1 += a[1];
+      e2 += a[2];
+    }
+    e[0] += b[0];
+    e[1] += b[1];
+    e[2] += b[2];
+  }
+}
+
+template <typename Scalar>
+template <typename Visitor>
+void TriangleT<Scalar>::rasterHierarchical(Visitor &visit, int w, int h, const PixelRect &clip) const
+{
+  EdgeFunctions edges;
+  if ( !setupEdges(edges, w, h) )
+    return;
+
+  const PixelRect r = edges.bounds.intersected(clip);
+  if ( r.empty() )
+    return;
+
+  const int64_t *a = edges.a;
+  const int64_t *b = edges.b;
+  const Scalar inv_area = Scalar(1) / edges.area;
+
+  // walk the blocks aligned to multiples of BLOCK_SIZE covering r
+  for ( int by = r.y0 & ~(BLOCK_SIZE-1); by <= r.y1; by += BLOCK_SIZE )
+    for ( int bx = r.x0 & ~(BLOCK_SIZE-1); bx <= r.x1; bx += BLOCK_SIZE )
+    {
+      const PixelRect block = PixelRect(bx, by, bx+BLOCK_SIZE-1, by+BLOCK_SIZE-1).intersected(r);
+
+      /* Edge functions are linear, so their extremes over a block lie on
+       * its corners: the block is outside if all corners are outside one
+       * edge, and inside if all corners are inside all edges.
+       */
+      bool outside = false;
+      bool inside = true;
+      int64_t e[3];
+      for ( size_t k=0; k < 3; k++ )
+      {
+        e[k] = edges.at(k, block.x0, block.y0);
+        const int64_t ex = a[k] * (block.x1 - block.x0);
+        const int64_t ey = b[k] * (block.y1 - block.y0);
+        const int64_t lo = e[k] + std::min(ex, int64_t(0)) + std::min(ey, int64_t(0));
+        const int64_t hi = e[k] + std::max(ex, int64_t(0)) + std::max(ey, int64_t(0));
+        outside = outside || hi < 0;
+        inside = inside && lo >= 0;
+      }
+      if ( outside )
+        continue;
+
+      // find each pixel, testing only blocks partially covered
+      for ( int j=block.y0; j <= block.y1; j++ )
+      {
+        int64_t e0 = e[0], e1 = e[1], e2 = e[2];
+        for ( int i=block.x0; i <= block.x1; i++ )
+        {
+          if ( inside || (e0 | e1 | e2) >= 0 )
+            visit(i, j, Vector3(e0*inv_area, e1*inv_area, e2*inv_area));
+          e0 += a[0];
+          e1 += a[1];
+          e2 += a[2];
+        }
+        e[0] += b[0];
+        e[1] += b[1];
+        e[2] += b[2];
+      }
+    }
+}
+
 #endif // __MODEL_HPP__
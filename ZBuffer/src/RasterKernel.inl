@@ -0,0 +1,282 @@
+/* Vectorized raster kernel of RasterSIMD.
+ *
+ * This file is included by RasterSIMD.cpp once per instruction set, inside
+ * a namespace providing the vector operations V, and compiled for that
+ * instruction set only.
+ */
+
+namespace {
+
+/// Triangle attributes in single precision
+struct ShadeSetup {
+  float v[3][3]; ///< vertex positions in view space
+  float n[3][3]; ///< vertex normals in view space
+
+  ShadeSetup(const Triangle &tri)
+  {
+    for ( size_t k=0; k < 3; k++ )
+      for ( size_t i=0; i < 3; i++ )
+      {
+        v[k][i] = float(tri.viewPositions[k](i));
+        n[k][i] = float(tri.normals[k](i));
+      }
+  }
+};
+
+inline V::F dot(const V::F a[3], const V::F b[3])
+{
+  return V::add(V::add(V::mul(a[0], b[0]), V::mul(a[1], b[1])), V::mul(a[2], b[2]));
+}
+
+inline void normalize(V::F a[3])
+{
+  const V::F inv_len = V::div(V::set1(1.0f), V::sqrt(dot(a, a)));
+  for ( size_t i=0; i < 3; i++ )
+    a[i] = V::mul(a[i], inv_len);
+}
+
+inline V::F interpolate(const float attr[3][3], size_t i,
+                        V::F t0, V::F t1, V::F t2)
+{
+  return V::add(V::add(V::mul(t0, V::set1(attr[0][i])),
+                       V::mul(t1, V::set1(attr[1][i]))),
+                       V::mul(t2, V::set1(attr[2][i])));
+}
+
+inline V::F powi(V::F x, int n)
+{
+  V::F result = V::set1(1.0f);
+  for ( ; n; n >>= 1 )
+  {
+    if ( n & 1 )
+      result = V::mul(result, x);
+    x = V::mul(x, x);
+  }
+  return result;
+}
+
+/** \brief Vectorized Triangle::getColor().
+ */
+inline V::I shade(const ShadeSetup &s, V::F t0, V::F t1, V::F t2)
+{
+  V::F v[3], n[3], li[3], vi[3], h[3];
+  for ( size_t i=0; i < 3; i++ )
+  {
+    v[i] = interpolate(s.v, i, t0, t1, t2);
+    n[i] = interpolate(s.n, i, t0, t1, t2);
+    li[i] = V::sub(V::set1(Triangle::LIGHT_POSITION[i]), v[i]);
+    vi[i] = V::sub(V::set1(0.0f), v[i]);
+  }
+  normalize(n);
+  normalize(li);
+  normalize(vi);
+  for ( size_t i=0; i < 3; i++ )
+    h[i] = V::add(li[i], vi[i]);
+  normalize(h);
+
+  const V::F zero = V::set1(0.0f);
+  const V::F one = V::set1(1.0f);
+  const V::F ndotl = dot(n, li);
+  const V::F ndoth = dot(n, h);
+  const V::F diffuse = V::select(V::gt(ndotl, zero), ndotl, zero);
+  const V::F specular = V::select(V::ge(ndoth, zero), powi(ndoth, Triangle::SHININESS), zero);
+
+  V::I rgb[3];
+  for ( size_t i=0; i < 3; i++ )
+  {
+    V::F c = V::set1(0.3f * Triangle::DIFFUSE[i]);
+    c = V::add(c, V::mul(V::set1(Triangle::DIFFUSE[i]), diffuse));
+    c = V::add(c, V::mul(V::set1(Triangle::SPECULAR[i]), specular));
+    c = V::min(V::max(c, zero), one);
+    rgb[i] = V::cvtt(V::mul(c, V::set1(255.0f)));
+  }
+  return V::pack(rgb[0], rgb[1], rgb[2]);
+}
+
+/** \brief Drop the sub-pixel bits of the edge functions, rounding down.
+ *
+ * a and b are whole multiples of SUBPIXEL_SCALE, so this divides E_k at
+ * every pixel exactly the same way, keeping its sign and so the coverage,
+ * and the bits dropped are the same along a row.
+ */
+void dropSubpixels(EdgeFunctions &edges)
+{
+  const int64_t scale = Triangle::SUBPIXEL_SCALE;
+  for ( size_t k=0; k < 3; k++ )
+  {
+    const int64_t c = edges.c[k];
+    edges.a[k] /= scale;
+    edges.b[k] /= scale;
+    edges.c[k] = c >= 0 ? c / scale : -((-c + scale - 1) / scale);
+  }
+}
+
+/** \brief Whether E_k stays within 32 bits over r widened by a lane block.
+ */
+bool fitsInt32(const EdgeFunctions &edges, const PixelRect &r)
+{
+  const int64_t limit = INT32_MAX / 2;
+  for ( size_t k=0; k < 3; k++ )
+  {
+    if ( std::abs(edges.a[k]) * V::N > limit )
+      return false;
+    const int xs[2] = {r.x0, r.x1 + V::N};
+    const int ys[2] = {r.y0, r.y1};
+    for ( size_t i=0; i < 2; i++ )
+      for ( size_t j=0; j < 2; j++ )
+        if ( std::abs(edges.at(k, xs[i], ys[j])) > limit )
+          return false;
+  }
+  return true;
+}
+
+template <RasterSIMD::Pass PASS>
+bool rasterPass(const Triangle &tri, int w, int h, const PixelRect &clip,
+                float *depth, size_t depth_pitch, uint32_t *color, size_t &shaded,
+                uint32_t *ids, uint32_t id)
+{
+  EdgeFunctions edges;
+  if ( !tri.setupEdges(edges, w, h) )
+    return true;
+
+  const PixelRect r = edges.bounds.intersected(clip);
+  if ( r.empty() )
+    return true;
+  EdgeFunctions coarse = edges;
+  dropSubpixels(coarse);
+  if ( !fitsInt32(coarse, r) )
+    return false;
+
+  const ShadeSetup s(tri);
+  const float z[3] = {float(tri.vertices[0].z()), float(tri.vertices[1].z()),
+                      float(tri.vertices[2].z())};
+  const float inv_area = 1.0f / float(edges.area);
+  const V::F coarse_inv_area = V::set1(float(Triangle::SUBPIXEL_SCALE) * inv_area);
+
+  // edge offsets of each lane, and step of a whole block of lanes
+  int32_t lanes[3][V::N];
+  V::I lane_offset[3], block_step[3];
+  for ( size_t k=0; k < 3; k++ )
+  {
+    for ( int i=0; i < V::N; i++ )
+      lanes[k][i] = int32_t(coarse.a[k] * i);
+    lane_offset[k] = V::loadi(lanes[k]);
+    block_step[k] = V::set1i(int32_t(coarse.a[k] * V::N));
+  }
+  int32_t lane_index[V::N];
+  for ( int i=0; i < V::N; i++ )
+    lane_index[i] = i;
+  const V::I lane_ids = V::loadi(lane_index);
+  const V::I triangle_id = V::set1i(int32_t(id));
+
+  for ( int y=r.y0; y <= r.y1; y++ )
+  {
+    // E_k = SUBPIXEL_SCALE * e[k] + rest[k] all along the row
+    V::I e[3];
+    V::F rest[3];
+    for ( size_t k=0; k < 3; k++ )
+    {
+      const int64_t row = coarse.at(k, r.x0, y);
+      e[k] = V::addi(V::set1i(int32_t(row)), lane_offset[k]);
+      rest[k] = V::set1(float(edges.at(k, r.x0, y) - row * Triangle::SUBPIXEL_SCALE) * inv_area);
+    }
+
+    float *depth_row = depth + size_t(y) * depth_pitch;
+    uint32_t *color_row = color + size_t(h-y-1) * w;
+    uint32_t *id_row = PASS != RasterSIMD::PASS_DIRECT ? ids + size_t(y) * w : 0;
+
+    for ( int x=r.x0; x <= r.x1; x += V::N )
+    {
+      const int count = std::min(int(V::N), r.x1 - x + 1);
+      V::I mask = V::inside(V::ori(V::ori(e[0], e[1]), e[2]));
+      if ( count < V::N )
+        mask = V::andi(mask, V::lti(lane_ids, V::set1i(count)));
+
+      if ( V::any(mask) )
+      {
+        // blocks running over the clip rectangle go through a copy
+        float depth_tail[V::N];
+        uint32_t color_tail[V::N];
+        uint32_t id_tail[V::N];
+        float *d = depth_row + x;
+        uint32_t *c = color_row + x;
+        uint32_t *ti = PASS != RasterSIMD::PASS_DIRECT ? id_row + x : 0;
+        if ( count < V::N )
+        {
+          if ( PASS != RasterSIMD::PASS_VISIBLE )
+          {
+            std::copy(d, d + count, depth_tail);
+            d = depth_tail;
+          }
+          if ( PASS != RasterSIMD::PASS_DEPTH )
+          {
+            std::copy(c, c + count, color_tail);
+            c = color_tail;
+          }
+          if ( PASS != RasterSIMD::PASS_DIRECT )
+          {
+            std::copy(ti, ti + count, id_tail);
+            ti = id_tail;
+          }
+        }
+
+        const V::F t0 = V::add(V::mul(V::cvt(e[0]), coarse_inv_area), rest[0]);
+        const V::F t1 = V::add(V::mul(V::cvt(e[1]), coarse_inv_area), rest[1]);
+        const V::F t2 = V::add(V::mul(V::cvt(e[2]), coarse_inv_area), rest[2]);
+        const V::F zt = V::add(V::add(V::mul(t0, V::set1(z[0])),
+                                      V::mul(t1, V::set1(z[1]))),
+                                      V::mul(t2, V::set1(z[2])));
+        // the pass after PASS_DEPTH tests the triangle ID instead of depth
+        const V::F zb = PASS == RasterSIMD::PASS_VISIBLE ? zt : V::loadf(d);
+        mask = V::andi(mask, PASS == RasterSIMD::PASS_VISIBLE
+                             ? V::eqi(V::loadi(ti), triangle_id) : V::lt(zt, zb));
+
+        if ( V::any(mask) )
+        {
+          shaded += V::count(mask);
+          if ( PASS != RasterSIMD::PASS_VISIBLE )
+            V::storef(d, V::select(mask, zt, zb));
+          if ( PASS != RasterSIMD::PASS_DEPTH )
+            V::storei(c, V::selecti(mask, shade(s, t0, t1, t2), V::loadi(c)));
+          if ( PASS == RasterSIMD::PASS_DEPTH )
+            V::storei(ti, V::selecti(mask, triangle_id, V::loadi(ti)));
+          if ( count < V::N )
+          {
+            if ( PASS != RasterSIMD::PASS_VISIBLE )
+              std::copy(depth_tail, depth_tail + count, depth_row + x);
+            if ( PASS != RasterSIMD::PASS_DEPTH )
+              std::copy(color_tail, color_tail + count, color_row + x);
+            if ( PASS == RasterSIMD::PASS_DEPTH )
+              std::copy(id_tail, id_tail + count, id_row + x);
+          }
+        }
+      }
+
+      for ( size_t k=0; k < 3; k++ )
+        e[k] = V::addi(e[k], block_step[k]);
+    }
+  }
+  return true;
+}
+
+bool raster(const Triangle &tri, int w, int h, const PixelRect &clip,
+            float *depth, size_t depth_pitch, uint32_t *color, size_t &shaded,
+            RasterSIMD::Pass pass, uint32_t *ids, uint32_t id)
+{
+  // one copy of the loop per pass, with the unused stores compiled out
+  switch ( pass )
+  {
+    case RasterSIMD::PASS_DIRECT:
+      return rasterPass<RasterSIMD::PASS_DIRECT>(tri, w, h, clip, depth, depth_pitch,
+                                                 color, shaded, ids, id);
+    case RasterSIMD::PASS_DEPTH:
+      return rasterPass<RasterSIMD::PASS_DEPTH>(tri, w, h, clip, depth, depth_pitch,
+                                                color, shaded, ids, id);
+    case RasterSIMD::PASS_VISIBLE:
+      return rasterPass<RasterSIMD::PASS_VISIBLE>(tri, w, h, clip, depth, depth_pitch,
+                                                  color, shaded, ids, id);
+  }
+  return false;
+}
+
+}
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cstdlib>
+#include "RasterSIMD.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RASTER_SIMD_X86
+#endif
+
+#ifdef RASTER_SIMD_X86
+#include <immintrin.h>
+
+/* Each instruction set gets its own copy of the kernel, compiled with the
+ * matching target, so the rest of the program needs no special flags.
+ */
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace sse2 {
+
+struct V {
+  enum { N = 4 };
+  typedef __m128 F;
+  typedef __m128i I;
+
+  static F set1(float a) { return _mm_set1_ps(a); }
+  static F add(F a, F b) { return _mm_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+  static F div(F a, F b) { return _mm_div_ps(a, b); }
+  static F sqrt(F a) { return _mm_sqrt_ps(a); }
+  static F min(F a, F b) { return _mm_min_ps(a, b); }
+  static F max(F a, F b) { return _mm_max_ps(a, b); }
+  static F cvt(I a) { return _mm_cvtepi32_ps(a); }
+  static I cvtt(F a) { return _mm_cvttps_epi32(a); }
+  static F loadf(const float *p) { return _mm_loadu_ps(p); }
+  static void storef(float *p, F a) { _mm_storeu_ps(p, a); }
+
+  static I set1i(int32_t a) { return _mm_set1_epi32(a); }
+  static I addi(I a, I b) { return _mm_add_epi32(a, b); }
+  static I andi(I a, I b) { return _mm_and_si128(a, b); }
+  static I ori(I a, I b) { return _mm_or_si128(a, b); }
+  static I loadi(const void *p) { return _mm_loadu_si128((const __m128i*)p); }
+  static void storei(void *p, I a) { _mm_storeu_si128((__m128i*)p, a); }
+
+  // masks have all bits of a lane set where the condition holds
+  static I lt(F a, F b) { return _mm_castps_si128(_mm_cmplt_ps(a, b)); }
+  static I gt(F a, F b) { return _mm_castps_si128(_mm_cmpgt_ps(a, b)); }
+  static I ge(F a, F b) { return _mm_castps_si128(_mm_cmpge_ps(a, b)); }
+  static I lti(I a, I b) { return _mm_cmplt_epi32(a, b); }
+  static I eqi(I a, I b) { return _mm_cmpeq_epi32(a, b); }
+  static I inside(I e) { return _mm_cmpgt_epi32(e, _mm_set1_epi32(-1)); }
+  static bool any(I m) { return _mm_movemask_epi8(m) != 0; }
+  static int count(I m) { return __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m))); }
+  static F select(I m, F a, F b)
+  {
+    const F mf = _mm_castsi128_ps(m);
+    return _mm_or_ps(_mm_and_ps(mf, a), _mm_andnot_ps(mf, b));
+  }
+  static I selecti(I m, I a, I b)
+  {
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+  }
+
+  static I pack(I r, I g, I b)
+  {
+    return _mm_or_si128(_mm_or_si128(_mm_set1_epi32(0xff000000), _mm_slli_epi32(r, 16)),
+                        _mm_or_si128(_mm_slli_epi32(g, 8), b));
+  }
+};
+
+#include "RasterKernel.inl"
+#include "TransformKernel.inl"
+
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2 {
+
+struct V {
+  enum { N = 8 };
+  typedef __m256 F;
+  typedef __m256i I;
+
+  static F set1(float a) { return _mm256_set1_ps(a); }
+  static F add(F a, F b) { return _mm256_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+  static F div(F a, F b) { return _mm256_div_ps(a, b); }
+  static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+  static F min(F a, F b) { return _mm256_min_ps(a, b); }
+  static F max(F a, F b) { return _mm256_max_ps(a, b); }
+  static F cvt(I a) { return _mm256_cvtepi32_ps(a); }
+  static I cvtt(F a) { return _mm256_cvttps_epi32(a); }
+  static F loadf(const float *p) { return _mm256_loadu_ps(p); }
+  static void storef(float *p, F a) { _mm256_storeu_ps(p, a); }
+
+  static I set1i(int32_t a) { return _mm256_set1_epi32(a); }
+  static I addi(I a, I b) { return _mm256_add_epi32(a, b); }
+  static I andi(I a, I b) { return _mm256_and_si256(a, b); }
+  static I ori(I a, I b) { return _mm256_or_si256(a, b); }
+  static I loadi(const void *p) { return _mm256_loadu_si256((const __m256i*)p); }
+  static void storei(void *p, I a) { _mm256_storeu_si256((__m256i*)p, a); }
+
+  // masks have all bits of a lane set where the condition holds
+  static I lt(F a, F b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+  static I gt(F a, F b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+  static I ge(F a, F b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_GE_OQ)); }
+  static I lti(I a, I b) { return _mm256_cmpgt_epi32(b, a); }
+  static I eqi(I a, I b) { return _mm256_cmpeq_epi32(a, b); }
+  static I inside(I e) { return _mm256_cmpgt_epi32(e, _mm256_set1_epi32(-1)); }
+  static bool any(I m) { return _mm256_movemask_epi8(m) != 0; }
+  static int count(I m) { return __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m))); }
+  static F select(I m, F a, F b) { return _mm256_blendv_ps(b, a, _mm256_castsi256_ps(m)); }
+  static I selecti(I m, I a, I b) { return _mm256_blendv_epi8(b, a, m); }
+
+  static I pack(I r, I g, I b)
+  {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_set1_epi32(0xff000000), _mm256_slli_epi32(r, 16)),
+                           _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+  }
+};
+
+#include "RasterKernel.inl"
+#include "TransformKernel.inl"
+
+}
+#pragma GCC pop_options
+
+#endif // RASTER_SIMD_X86
+
+const size_t RasterSIMD::WIDTH;
+
+RasterSIMD::Level RasterSIMD::detect()
+{
+#ifdef RASTER_SIMD_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports("avx2") )
+    return LEVEL_AVX2;
+  if ( __builtin_cpu_supports("sse2") )
+    return LEVEL_SSE2;
+#endif
+  return LEVEL_NONE;
+}
+
+const char *RasterSIMD::levelName(Level level)
+{
+  switch ( level )
+  {
+    case LEVEL_SSE2:
+      return "SSE2";
+    case LEVEL_AVX2:
+      return "AVX2";
+    default:
+      return "scalar";
+  }
+}
+
+bool RasterSIMD::raster(Level level, const Triangle &tri, int w, int h,
+                        const PixelRect &clip, float *depth, size_t depth_pitch,
+                        uint32_t *color, size_t &shaded, Pass pass,
+                        uint32_t *ids, uint32_t id)
+{
+  switch ( level )
+  {
+#ifdef RASTER_SIMD_X86
+    case LEVEL_SSE2:
+      return sse2::raster(tri, w, h, clip, depth, depth_pitch, color, shaded, pass, ids, id);
+    case LEVEL_AVX2:
+      return avx2::raster(tri, w, h, clip, depth, depth_pitch, color, shaded, pass, ids, id);
+#endif
+    default:
+      return false;
+  }
+}
+
+void RasterSIMD::transform(Level level, const float m[16],
+                           const float *x, const float *y, const float *z,
+                           size_t n, float *out[4])
+{
+  switch ( level )
+  {
+#ifdef RASTER_SIMD_X86
+    case LEVEL_SSE2:
+      sse2::transform(m, x, y, z, n, out);
+      return;
+    case LEVEL_AVX2:
+      avx2::transform(m, x, y, z, n, out);
+      return;
+#endif
+    default:
+      break;
+  }
+
+  for ( size_t i=0; i < n; i++ )
+    for ( size_t k=0; k < 4; k++ )
+      out[k][i] = m[4*k] * x[i] + m[4*k+1] * y[i] + m[4*k+2] * z[i] + m[4*k+3];
+}
+
+void RasterSIMD::transformAffine(Level level, const float m[12],
+                                 const float *x, const float *y, const float *z,
+                                 size_t n, float *out[3])
+{
+  switch ( level )
+  {
+#ifdef RASTER_SIMD_X86
+    case LEVEL_SSE2:
+      sse2::transformAffine(m, x, y, z, n, out);
+      return;
+    case LEVEL_AVX2:
+      avx2::transformAffine(m, x, y, z, n, out);
+      return;
+#endif
+    default:
+      break;
+  }
+
+  for ( size_t i=0; i < n; i++ )
+    for ( size_t k=0; k < 3; k++ )
+      out[k][i] = m[4*k] * x[i] + m[4*k+1] * y[i] + m[4*k+2] * z[i] + m[4*k+3];
+}
@@ -0,0 +1,74 @@
+#ifndef __RASTER_SIMD_HPP__
+#define __RASTER_SIMD_HPP__
+
+#include <stdint.h>
+#include "Model.hpp"
+
+/** \brief Vectorized edge-function rasterizer.
+ *
+ * Evaluates coverage, depth, the depth test and Phong shading for a row
+ * of 8 (AVX2) or 4 (SSE2) pixels at once, in single precision. The
+ * instruction set is picked at runtime, so the same binary runs on any
+ * x86 host and falls back to the scalar rasterizer elsewhere.
+ *
+ * The same kernels also transform vertices in batches for the geometry
+ * stage.
+ */
+class RasterSIMD {
+public:
+  /// Widest batch of a kernel; arrays passed to transform() are padded to it
+  static const size_t WIDTH = 8;
+
+  enum Level {
+    LEVEL_NONE, ///< scalar code only
+    LEVEL_SSE2, ///< 4 pixels per instruction
+    LEVEL_AVX2  ///< 8 pixels per instruction
+  };
+
+  /// What raster() does with the pixels of a triangle
+  enum Pass {
+    PASS_DIRECT, ///< depth test, then write depth and shade
+    PASS_DEPTH,  ///< depth test and write depth and triangle ID only
+    PASS_VISIBLE ///< shade where the stored triangle ID is the triangle's
+  };
+
+public:
+  /** \brief Best instruction set supported by this host.
+   */
+  static Level detect();
+  static const char *levelName(Level level);
+
+  /** \brief Raster, depth test and shade the pixels of tri inside clip.
+   *
+   * depth holds rows of depth_pitch floats indexed by image coordinates, color
+   * holds w*h ARGB32 pixels with the top row first. Returns false without
+   * touching the buffers if the triangle cannot be handled at this level,
+   * e.g. if its edge functions overflow 32-bit lanes. The number of
+   * pixels passing the depth test is added to shaded; PASS_DEPTH leaves
+   * color untouched. PASS_DEPTH and PASS_VISIBLE also take ids, w*h
+   * triangle IDs indexed by image coordinates, and the ID of tri.
+   */
+  static bool raster(Level level, const Triangle &tri, int w, int h,
+                     const PixelRect &clip, float *depth, size_t depth_pitch,
+                     uint32_t *color, size_t &shaded, Pass pass=PASS_DIRECT,
+                     uint32_t *ids=0, uint32_t id=0);
+
+  /** \brief Multiply n points (x, y, z, 1) by the row-major 4x4 matrix m.
+   *
+   * The four homogeneous coordinates are written to out[0..3]. n must be
+   * a multiple of WIDTH.
+   */
+  static void transform(Level level, const float m[16],
+                        const float *x, const float *y, const float *z,
+                        size_t n, float *out[4]);
+  /** \brief Multiply n points (x, y, z, 1) by the first three rows m of an
+   * affine 4x4 matrix, writing x, y and z to out[0..2].
+   *
+   * With a zero last column it transforms directions, such as normals.
+   */
+  static void transformAffine(Level level, const float m[12],
+                              const float *x, const float *y, const float *z,
+                              size_t n, float *out[3]);
+};
+
+#endif //__RASTER_SIMD_HPP__
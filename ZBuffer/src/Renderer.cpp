@@ -0,0 +1,1104 @@
+#include <chrono>
+#include <cmath>
+#include "Renderer.hpp"
+#include "Logger.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsedMs(const Clock::time_point &start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/** \brief Depth test, shade and write each pixel as soon as it is rastered.
+ */
+template <typename Scalar>
+struct DepthTestWriter : public EigenTypesT<Scalar> {
+  typedef TriangleT<Scalar> Triangle;
+
+  const Triangle &triangle;
+  DepthBuffer &depth;
+  uint32_t *color;
+  int width, height;
+  size_t shaded;
+
+  DepthTestWriter(const Triangle &triangle, DepthBuffer &depth, uint32_t *color,
+                  int width, int height)
+    : triangle(triangle), depth(depth), color(color),
+      width(width), height(height), shaded(0)
+  {}
+
+  void operator()(int x, int y, const typename EigenTypesT<Scalar>::Vector3 &t)
+  {
+    if ( depth.testAndSet(x, y, triangle.getDepth(t)) )
+    {
+      color[(height-y-1)*width+x] = triangle.getColor(t);
+      shaded++;
+    }
+  }
+};
+
+/** \brief Depth test each pixel and write depth and triangle ID only.
+ */
+template <typename Scalar>
+struct DepthWriter : public EigenTypesT<Scalar> {
+  typedef TriangleT<Scalar> Triangle;
+
+  const Triangle &triangle;
+  uint32_t id;
+  DepthBuffer &depth;
+  uint32_t *ids;
+  int width;
+  size_t fragments;
+
+  DepthWriter(const Triangle &triangle, uint32_t id, DepthBuffer &depth,
+              uint32_t *ids, int width)
+    : triangle(triangle), id(id), depth(depth), ids(ids), width(width), fragments(0)
+  {}
+
+  void operator()(int x, int y, const typename EigenTypesT<Scalar>::Vector3 &t)
+  {
+    if ( depth.testAndSet(x, y, triangle.getDepth(t)) )
+    {
+      ids[size_t(y)*width+x] = id;
+      fragments++;
+    }
+  }
+};
+
+/** \brief Shade each pixel a depth pass left to the triangle.
+ */
+template <typename Scalar>
+struct VisibleWriter : public EigenTypesT<Scalar> {
+  typedef TriangleT<Scalar> Triangle;
+
+  const Triangle &triangle;
+  uint32_t id;
+  const uint32_t *ids;
+  uint32_t *color;
+  int width, height;
+  size_t shaded;
+
+  VisibleWriter(const Triangle &triangle, uint32_t id, const uint32_t *ids,
+                uint32_t *color, int width, int height)
+    : triangle(triangle), id(id), ids(ids), color(color),
+      width(width), height(height), shaded(0)
+  {}
+
+  void operator()(int x, int y, const typename EigenTypesT<Scalar>::Vector3 &t)
+  {
+    if ( ids[size_t(y)*width+x] == id )
+    {
+      color[(height-y-1)*width+x] = triangle.getColor(t);
+      shaded++;
+    }
+  }
+};
+
+/** \brief Depth test each pixel and record the visible triangle.
+ */
+template <typename Scalar>
+struct VisibilityWriter : public EigenTypesT<Scalar> {
+  typedef TriangleT<Scalar> Triangle;
+
+  const Triangle &triangle;
+  uint32_t id;
+  DepthBuffer &depth;
+  uint32_t *ids;
+  float *barycentrics;
+  int width;
+  size_t fragments;
+
+  VisibilityWriter(const Triangle &triangle, uint32_t id, DepthBuffer &depth,
+                   uint32_t *ids, float *barycentrics, int width)
+    : triangle(triangle), id(id), depth(depth), ids(ids),
+      barycentrics(barycentrics), width(width), fragments(0)
+  {}
+
+  void operator()(int x, int y, const typename EigenTypesT<Scalar>::Vector3 &t)
+  {
+    if ( depth.testAndSet(x, y, triangle.getDepth(t)) )
+    {
+      const size_t i = size_t(y)*width+x;
+      ids[i] = id;
+      barycentrics[2*i  ] = float(t.x());
+      barycentrics[2*i+1] = float(t.y());
+      fragments++;
+    }
+  }
+};
+
+/** \brief Run the SIMD kernel where there is one for the precision.
+ */
+bool rasterSIMD(RasterSIMD::Level level, const TriangleT<float> &t, int w, int h,
+                const PixelRect &clip, float *depth, size_t depth_pitch,
+                uint32_t *color, size_t &shaded, RasterSIMD::Pass pass,
+                uint32_t *ids=0, uint32_t id=0)
+{
+  return RasterSIMD::raster(level, t, w, h, clip, depth, depth_pitch, color, shaded, pass,
+                            ids, id);
+}
+
+bool rasterSIMD(RasterSIMD::Level, const TriangleT<double> &, int, int,
+                const PixelRect &, float *, size_t, uint32_t *, size_t &, RasterSIMD::Pass,
+                uint32_t * =0, uint32_t =0)
+{
+  return false;
+}
+
+/** \brief SIMD level usable at precision Scalar.
+ */
+RasterSIMD::Level simdLevelFor(RasterSIMD::Level level, float)
+{
+  return level;
+}
+
+RasterSIMD::Level simdLevelFor(RasterSIMD::Level, double)
+{
+  return RasterSIMD::LEVEL_NONE;
+}
+
+}
+
+const int RendererBase::TILE_SIZE;
+const uint32_t RendererBase::CLEAR_COLOR;
+const uint32_t RendererBase::NO_TRIANGLE;
+const uint32_t RendererBase::MICRO_TRIANGLE;
+const int RendererBase::SORT_KEY_BITS;
+const double RendererBase::OCCLUDER_FRACTION = 0.25;
+
+RenderStats::RenderStats()
+  : threads(0),
+    simd(RasterSIMD::LEVEL_NONE),
+    triangles(0),
+    tiles(0),
+    binned(0),
+    micro(0),
+    fragments(0),
+    shaded(0),
+    covered(0),
+    nodesTested(0),
+    nodesCulled(0),
+    trianglesCulled(0),
+    geometryMs(0.0),
+    binningMs(0.0),
+    rasterMs(0.0),
+    occlusionMs(0.0),
+    sortMs(0.0),
+    totalMs(0.0),
+    reused(false),
+    arenaBytes(0),
+    allocations(0)
+{
+}
+
+double RenderStats::shadingReduction() const
+{
+  return shaded ? double(fragments) / shaded : 1.0;
+}
+
+size_t RenderStats::overdraw() const
+{
+  return fragments > covered ? fragments - covered : 0;
+}
+
+double RenderStats::microFraction() const
+{
+  return triangles ? double(micro) / triangles : 0.0;
+}
+
+const char *RendererBase::shadingModeName(ShadingMode mode)
+{
+  switch ( mode )
+  {
+    case SHADING_DIRECT:
+      return "direct";
+    case SHADING_DEFERRED:
+      return "deferred";
+    case SHADING_DEPTH_PREPASS:
+      return "depth pre-pass";
+  }
+  return "unknown";
+}
+
+const char *RendererBase::engineName(Engine engine)
+{
+  switch ( engine )
+  {
+    case ENGINE_TILED:
+      return "tiled";
+    case ENGINE_SCANLINE:
+      return "scanline";
+    case ENGINE_INTERVAL:
+      return "interval";
+  }
+  return "unknown";
+}
+
+template <typename Scalar>
+RendererT<Scalar>::RendererT()
+  : m_engine(ENGINE_TILED),
+    m_rasterMode(Triangle::RASTER_EDGE_FUNCTION),
+    m_simdLevel(RasterSIMD::LEVEL_NONE),
+    m_shadingMode(SHADING_DIRECT),
+    m_cullMode(Model::CULL_BACK),
+    m_occlusionCulling(false),
+    m_frontToBack(false),
+    m_pool(new ThreadPool()),
+    m_width(0),
+    m_height(0),
+    m_tilesX(0),
+    m_tilesY(0),
+    m_binFirst(0),
+    m_clearTiles(true),
+    m_frameValid(false),
+    m_lastModel(0)
+{
+}
+
+template <typename Scalar>
+RendererT<Scalar>::~RendererT()
+{
+  delete m_pool;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setEngine(Engine engine)
+{
+  m_engine = engine;
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+RendererBase::Engine RendererT<Scalar>::engine() const
+{
+  return m_engine;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setRasterMode(TriangleBase::RasterMode mode)
+{
+  m_rasterMode = mode;
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+TriangleBase::RasterMode RendererT<Scalar>::rasterMode() const
+{
+  return m_rasterMode;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setSimdLevel(RasterSIMD::Level level)
+{
+  m_simdLevel = std::min(level, RasterSIMD::detect());
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+RasterSIMD::Level RendererT<Scalar>::simdLevel() const
+{
+  return m_simdLevel;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setShadingMode(ShadingMode mode)
+{
+  m_shadingMode = mode;
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+RendererBase::ShadingMode RendererT<Scalar>::shadingMode() const
+{
+  return m_shadingMode;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setDepthFormat(DepthBuffer::Format format)
+{
+  m_depthBuffer.setFormat(format);
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+DepthBuffer::Format RendererT<Scalar>::depthFormat() const
+{
+  return m_depthBuffer.format();
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setDepthLayout(DepthBuffer::Layout layout)
+{
+  m_depthBuffer.setLayout(layout);
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+DepthBuffer::Layout RendererT<Scalar>::depthLayout() const
+{
+  return m_depthBuffer.layout();
+}
+
+template <typename Scalar>
+size_t RendererT<Scalar>::depthBytes() const
+{
+  return m_depthBuffer.bytes();
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setCullMode(Model::CullMode mode)
+{
+  m_cullMode = mode;
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+Model::CullMode RendererT<Scalar>::cullMode() const
+{
+  return m_cullMode;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setOcclusionCulling(bool enabled)
+{
+  m_occlusionCulling = enabled;
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+bool RendererT<Scalar>::occlusionCulling() const
+{
+  return m_occlusionCulling;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setFrontToBack(bool enabled)
+{
+  m_frontToBack = enabled;
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+bool RendererT<Scalar>::frontToBack() const
+{
+  return m_frontToBack;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::setNumThreads(size_t numThreads)
+{
+  delete m_pool;
+  m_pool = new ThreadPool(numThreads);
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+size_t RendererT<Scalar>::numThreads() const
+{
+  return m_pool->numThreads();
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::invalidate()
+{
+  m_frameValid = false;
+}
+
+template <typename Scalar>
+int RendererT<Scalar>::width() const
+{
+  return m_width;
+}
+
+template <typename Scalar>
+int RendererT<Scalar>::height() const
+{
+  return m_height;
+}
+
+template <typename Scalar>
+const uint32_t *RendererT<Scalar>::colorBuffer() const
+{
+  return m_colorBuffer.empty() ? 0 : &m_colorBuffer[0];
+}
+
+template <typename Scalar>
+const RenderStats &RendererT<Scalar>::stats() const
+{
+  return m_stats;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::resize(int width, int height)
+{
+  if ( width == m_width && height == m_height )
+    return;
+
+  m_width = width;
+  m_height = height;
+  m_tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+  m_tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+  m_colorBuffer.resize(size_t(width) * height);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::resetArena()
+{
+  // the old contents need no freeing; the new containers are empty
+  const ArenaAllocator<uint32_t> alloc(&m_arena);
+  const size_t last_triangles = m_triangles.size();
+  m_triangles = TriangleList(alloc);
+  m_bins.resize(numThreads());
+  for ( size_t i=0; i < m_bins.size(); i++ )
+  {
+    m_bins[i].resize(size_t(m_tilesX) * m_tilesY);
+    for ( size_t j=0; j < m_bins[i].size(); j++ )
+      m_bins[i][j] = FrameVector<uint32_t>(alloc);
+  }
+  m_micro.resize(m_bins.size());
+  for ( size_t i=0; i < m_micro.size(); i++ )
+    m_micro[i] = FrameVector<MicroTriangle>(alloc);
+  m_binMicro.resize(m_bins.size());
+  m_arena.reset();
+
+  // room for about as many triangles as last frame, so that they are
+  // not copied over and over while the list grows
+  m_triangles.reserve(last_triangles + last_triangles / 8);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::render(Model &model, const Matrix4 &modelView, const Matrix4 &projection,
+                               int width, int height)
+{
+  const Clock::time_point start = Clock::now();
+  const size_t allocations = FrameArena::heapAllocations();
+
+  // nothing changed since the last frame, so its image still holds
+  if ( m_frameValid && &model == m_lastModel && width == m_width && height == m_height
+    && modelView == m_lastModelView && projection == m_lastProjection )
+  {
+    m_stats.reused = true;
+    m_stats.geometryMs = m_stats.binningMs = m_stats.rasterMs = m_stats.occlusionMs
+      = m_stats.sortMs = 0.0;
+    m_stats.allocations = FrameArena::heapAllocations() - allocations;
+    m_stats.totalMs = elapsedMs(start);
+    return;
+  }
+  m_frameValid = true;
+  m_lastModel = &model;
+  m_lastModelView = modelView;
+  m_lastProjection = projection;
+
+  resize(width, height);
+  resetArena();
+  if ( m_engine != ENGINE_TILED )
+  {
+    // the scan-line engines need no full frame depth buffer
+    m_depthBuffer.release();
+    renderScanline(model, modelView, projection);
+    m_stats.arenaBytes = m_arena.used();
+    m_stats.allocations = FrameArena::heapAllocations() - allocations;
+    m_stats.totalMs = elapsedMs(start);
+    return;
+  }
+
+  m_depthBuffer.resize(width, height);
+  if ( m_shadingMode != SHADING_DIRECT )
+    m_triangleIds.resize(size_t(width) * height);
+  if ( m_shadingMode == SHADING_DEFERRED )
+    m_barycentrics.resize(2 * size_t(width) * height);
+  m_stats = RenderStats();
+  m_stats.threads = numThreads();
+  m_stats.simd = m_shadingMode != SHADING_DEFERRED && m_depthBuffer.floatRows()
+    ? simdLevelFor(m_simdLevel, Scalar()) : RasterSIMD::LEVEL_NONE;
+  m_stats.tiles = size_t(m_tilesX) * m_tilesY;
+  m_tileStats.assign(m_stats.tiles, TileStats());
+
+  if ( m_occlusionCulling )
+  {
+    renderOccluded(model, modelView, projection);
+  }
+  else
+  {
+    // geometry: transform and filter the triangles
+    Clock::time_point stage = Clock::now();
+    model.getTriangles(m_triangles, modelView, projection, m_cullMode, m_stats.geometry, m_pool);
+    m_stats.geometryMs += elapsedMs(stage);
+
+    if ( m_frontToBack )
+      sortTriangles(0);
+    rasterPass(0, true);
+  }
+  m_stats.triangles = m_triangles.size();
+
+  // resolve: shade the visibility buffer
+  if ( m_shadingMode == SHADING_DEFERRED )
+  {
+    Clock::time_point stage = Clock::now();
+    m_pool->run(m_stats.tiles, [this](size_t i){ resolveTile(i); });
+    m_stats.rasterMs += elapsedMs(stage);
+  }
+
+  for ( size_t i=0; i < m_tileStats.size(); i++ )
+  {
+    m_stats.fragments += m_tileStats[i].fragments;
+    m_stats.shaded += m_tileStats[i].shaded;
+    m_stats.covered += m_tileStats[i].covered;
+  }
+  m_stats.arenaBytes = m_arena.used();
+  m_stats.allocations = FrameArena::heapAllocations() - allocations;
+  m_stats.totalMs = elapsedMs(start);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::renderScanline(Model &model, const Matrix4 &modelView,
+                                       const Matrix4 &projection)
+{
+  m_stats = RenderStats();
+  m_stats.threads = 1;
+
+  Clock::time_point stage = Clock::now();
+  model.getTriangles(m_triangles, modelView, projection, m_cullMode, m_stats.geometry);
+  m_stats.geometryMs += elapsedMs(stage);
+  m_stats.triangles = m_triangles.size();
+  // the interval engine has no depth test for the order to help
+  if ( m_frontToBack && m_engine == ENGINE_SCANLINE )
+    sortTriangles(0);
+
+  stage = Clock::now();
+  m_scanline.render(m_triangles, m_width, m_height, &m_colorBuffer[0], CLEAR_COLOR,
+                    m_engine == ENGINE_SCANLINE ? ScanlineZBufferT<Scalar>::VISIBILITY_ZBUFFER
+                                                : ScanlineZBufferT<Scalar>::VISIBILITY_INTERVAL);
+  m_stats.rasterMs += elapsedMs(stage);
+  m_stats.fragments = m_scanline.fragments();
+  m_stats.shaded = m_scanline.shaded();
+  m_stats.covered = m_scanline.covered();
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::rasterPass(size_t first, bool clear)
+{
+  // binning: each thread sorts a contiguous chunk of triangles into tiles
+  Clock::time_point stage = Clock::now();
+  const size_t chunks = m_bins.size();
+  m_binFirst = first;
+  m_pool->run(chunks, [this](size_t i){ binTriangles(i); });
+  for ( size_t i=0; i < chunks; i++ )
+  {
+    for ( size_t j=0; j < m_bins[i].size(); j++ )
+      m_stats.binned += m_bins[i][j].size();
+    m_stats.micro += m_binMicro[i];
+  }
+  m_stats.binningMs += elapsedMs(stage);
+
+  // raster: each tile is owned by a single thread
+  stage = Clock::now();
+  m_clearTiles = clear;
+  m_pool->run(m_stats.tiles, [this](size_t i){ rasterTile(i); });
+  m_stats.rasterMs += elapsedMs(stage);
+}
+
+namespace {
+
+/** \brief Project a bounding box to a screen rectangle and nearest depth.
+ *
+ * Boxes reaching behind the eye cover the whole screen at depth -1.
+ */
+template <typename Scalar>
+void projectBox(const BVHNode &node, const typename EigenTypesT<Scalar>::Matrix4 &transform,
+                int width, int height, PixelRect &rect, float &near)
+{
+  double x[2] = {HUGE_VAL, -HUGE_VAL};
+  double y[2] = {HUGE_VAL, -HUGE_VAL};
+  double z = HUGE_VAL;
+
+  for ( int i=0; i < 8; i++ )
+  {
+    typename EigenTypesT<Scalar>::Vector4 v(i & 1 ? node.hi.x() : node.lo.x(),
+                                            i & 2 ? node.hi.y() : node.lo.y(),
+                                            i & 4 ? node.hi.z() : node.lo.z(), 1);
+    v = transform * v;
+    if ( v.w() <= 0 )
+    {
+      rect = PixelRect(0, 0, width-1, height-1);
+      near = -1.0f;
+      return;
+    }
+    v /= v.w();
+    x[0] = std::min(x[0], double(v.x()));
+    x[1] = std::max(x[1], double(v.x()));
+    y[0] = std::min(y[0], double(v.y()));
+    y[1] = std::max(y[1], double(v.y()));
+    z = std::min(z, double(v.z()));
+  }
+
+  // every pixel center a triangle inside may cover, clamped to keep the
+  // conversion in range
+  rect = PixelRect(int((std::max(x[0], -2.0) + 1.0f) / 2.0f * width),
+                   int((std::max(y[0], -2.0) + 1.0f) / 2.0f * height),
+                   int((std::min(x[1], 2.0) + 1.0f) / 2.0f * width),
+                   int((std::min(y[1], 2.0) + 1.0f) / 2.0f * height))
+    .intersected(PixelRect(0, 0, width-1, height-1));
+  near = float(z);
+}
+
+/// A BVH leaf and its projection
+struct LeafRef {
+  uint32_t shape, node;
+  float near;
+
+  bool operator<(const LeafRef &l) const
+  {
+    if ( near != l.near )
+      return near < l.near;
+    return shape != l.shape ? shape < l.shape : node < l.node;
+  }
+};
+
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::renderOccluded(Model &model, const Matrix4 &modelView,
+                                       const Matrix4 &projection)
+{
+  /* Occlusion culling runs in two passes:
+   * 1. Render the nearest leaves of all BVHs as occluders.
+   * 2. Build the Z pyramid over the depth buffer, then walk the BVHs and
+   *    skip every node whose box lies behind the pyramid; render the
+   *    remaining leaves.
+   */
+  Clock::time_point stage = Clock::now();
+  const Matrix4 transform = projection * modelView;
+  const ArenaAllocator<uint32_t> alloc(&m_arena);
+  FrameVector<LeafRef> leaves(alloc);
+  m_occluders.resize(model.numShapes());
+  for ( size_t s=0; s < model.numShapes(); s++ )
+  {
+    const std::vector<BVHNode> &nodes = model.bvh(s);
+    m_occluders[s].assign(nodes.size(), 0);
+    for ( size_t i=0; i < nodes.size(); i++ )
+    {
+      if ( !nodes[i].isLeaf() )
+        continue;
+
+      LeafRef leaf;
+      PixelRect rect;
+      leaf.shape = uint32_t(s);
+      leaf.node = uint32_t(i);
+      projectBox<Scalar>(nodes[i], transform, m_width, m_height, rect, leaf.near);
+      if ( !rect.empty() )
+        leaves.push_back(leaf);
+    }
+  }
+  std::sort(leaves.begin(), leaves.end());
+  const size_t n_occluders = size_t(std::ceil(leaves.size() * OCCLUDER_FRACTION));
+  m_stats.occlusionMs += elapsedMs(stage);
+
+  // pass 1: occluders
+  stage = Clock::now();
+  FrameVector<Model::NodeRef> occluders(n_occluders, Model::NodeRef(), alloc);
+  for ( size_t i=0; i < n_occluders; i++ )
+  {
+    const LeafRef &leaf = leaves[i];
+    m_occluders[leaf.shape][leaf.node] = 1;
+    occluders[i] = Model::NodeRef(leaf.shape, leaf.node);
+  }
+  model.getTriangles(m_triangles, modelView, projection, occluders, m_cullMode,
+                     m_stats.geometry, m_pool);
+  m_stats.geometryMs += elapsedMs(stage);
+  if ( m_frontToBack )
+    sortTriangles(0);
+  rasterPass(0, true);
+
+  // pass 2: everything not hidden behind the occluders
+  stage = Clock::now();
+  m_hiz.build(m_depthBuffer);
+  FrameVector<uint32_t> stack(alloc);
+  FrameVector<Model::NodeRef> visible(alloc);
+  for ( size_t s=0; s < model.numShapes(); s++ )
+  {
+    const std::vector<BVHNode> &nodes = model.bvh(s);
+    if ( nodes.empty() )
+      continue;
+
+    stack.assign(1, 0);
+    while ( !stack.empty() )
+    {
+      const BVHNode &node = nodes[stack.back()];
+      const uint32_t i = stack.back();
+      stack.pop_back();
+
+      if ( m_occluders[s][i] )
+        continue;
+
+      PixelRect rect;
+      float near;
+      projectBox<Scalar>(node, transform, m_width, m_height, rect, near);
+      m_stats.nodesTested++;
+      if ( rect.empty() || m_hiz.occluded(rect, near) )
+      {
+        m_stats.nodesCulled++;
+        m_stats.trianglesCulled += node.count;
+        continue;
+      }
+
+      if ( node.isLeaf() )
+      {
+        visible.push_back(std::make_pair(uint32_t(s), i));
+      }
+      else
+      {
+        stack.push_back(node.right);
+        stack.push_back(node.left);
+      }
+    }
+  }
+  m_stats.occlusionMs += elapsedMs(stage);
+
+  stage = Clock::now();
+  const size_t first = m_triangles.size();
+  model.getTriangles(m_triangles, modelView, projection, visible, m_cullMode,
+                     m_stats.geometry, m_pool);
+  m_stats.geometryMs += elapsedMs(stage);
+  if ( m_frontToBack )
+    sortTriangles(first);
+  rasterPass(first, false);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::sortTriangles(size_t first)
+{
+  const size_t n = m_triangles.size() - first;
+  if ( n < 2 )
+    return;
+
+  const Clock::time_point stage = Clock::now();
+  const ArenaAllocator<uint32_t> alloc(&m_arena);
+
+  // keys: centroid distance in front of the camera, quantized over the pass
+  FrameVector<float> depths(n, 0.0f, alloc);
+  float near = HUGE_VALF, far = -HUGE_VALF;
+  for ( size_t i=0; i < n; i++ )
+  {
+    const Triangle &t = m_triangles[first + i];
+    depths[i] = -float(t.viewPositions[0].z() + t.viewPositions[1].z()
+                       + t.viewPositions[2].z()) / 3.0f;
+    near = std::min(near, depths[i]);
+    far = std::max(far, depths[i]);
+  }
+  const float scale = far > near ? float((1 << SORT_KEY_BITS) - 1) / (far - near) : 0.0f;
+  FrameVector<uint32_t> keys(n, 0, alloc);
+  for ( size_t i=0; i < n; i++ )
+    keys[i] = uint32_t((depths[i] - near) * scale);
+
+  // least significant byte first; every pass is stable, so triangles of
+  // equal keys keep their submission order
+  FrameVector<uint32_t> order(n, 0, alloc);
+  FrameVector<uint32_t> next(n, 0, alloc);
+  for ( size_t i=0; i < n; i++ )
+    order[i] = uint32_t(i);
+  for ( int shift=0; shift < SORT_KEY_BITS; shift += 8 )
+  {
+    size_t offsets[257] = {0};
+    for ( size_t i=0; i < n; i++ )
+      offsets[((keys[order[i]] >> shift) & 0xff) + 1]++;
+    for ( int d=0; d < 256; d++ )
+      offsets[d+1] += offsets[d];
+    for ( size_t i=0; i < n; i++ )
+      next[offsets[(keys[order[i]] >> shift) & 0xff]++] = order[i];
+    order.swap(next);
+  }
+
+  TriangleList sorted(alloc);
+  sorted.reserve(n);
+  for ( size_t i=0; i < n; i++ )
+    sorted.push_back(m_triangles[first + order[i]]);
+  std::copy(sorted.begin(), sorted.end(), m_triangles.begin() + first);
+  m_stats.sortMs += elapsedMs(stage);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::binTriangles(size_t chunk)
+{
+  const size_t chunks = m_bins.size();
+  const size_t n = m_triangles.size() - m_binFirst;
+  const size_t begin = m_binFirst + n * chunk / chunks;
+  const size_t end = m_binFirst + n * (chunk+1) / chunks;
+
+  std::vector<FrameVector<uint32_t> > &bins = m_bins[chunk];
+  for ( size_t i=0; i < bins.size(); i++ )
+    bins[i].clear();
+
+  FrameVector<MicroTriangle> &micros = m_micro[chunk];
+  micros.clear();
+
+  const PixelRect screen(0, 0, m_width-1, m_height-1);
+  const bool sample_micro = m_rasterMode == Triangle::RASTER_EDGE_FUNCTION;
+  size_t micro = 0;
+  for ( size_t i=begin; i < end; i++ )
+  {
+    int xd[3];
+    int yd[3];
+    m_triangles[i].snap(xd, yd, m_width, m_height);
+    const PixelRect bounds = Triangle::bounds(xd, yd);
+    if ( bounds.empty() )
+    {
+      // too small to reach any pixel center
+      micro++;
+      continue;
+    }
+    if ( sample_micro && bounds.x1 - bounds.x0 + bounds.y1 - bounds.y0 <= 1 )
+    {
+      // one or two pixel centers: sample them now and bin the covered ones
+      micro++;
+      MicroTriangle m;
+      m.triangle = uint32_t(i);
+      m.count = Triangle::sampleMicro(xd, yd, m.x, m.y, m.t);
+      const uint32_t entry = uint32_t(micros.size()) | MICRO_TRIANGLE;
+      int last_tile = -1;
+      for ( int k=0; k < m.count; k++ )
+      {
+        if ( m.x[k] < 0 || m.x[k] >= m_width || m.y[k] < 0 || m.y[k] >= m_height )
+          continue;
+        const int tile = (m.y[k] / TILE_SIZE) * m_tilesX + m.x[k] / TILE_SIZE;
+        if ( tile != last_tile )
+          bins[tile].push_back(entry);
+        last_tile = tile;
+      }
+      if ( last_tile >= 0 )
+        micros.push_back(m);
+      continue;
+    }
+
+    const uint32_t entry = uint32_t(i);
+    const PixelRect r = bounds.intersected(screen);
+    if ( r.empty() )
+      continue;
+
+    for ( int ty = r.y0 / TILE_SIZE; ty <= r.y1 / TILE_SIZE; ty++ )
+      for ( int tx = r.x0 / TILE_SIZE; tx <= r.x1 / TILE_SIZE; tx++ )
+        bins[ty*m_tilesX+tx].push_back(entry);
+  }
+  m_binMicro[chunk] = micro;
+}
+
+template <typename Scalar>
+const typename RendererT<Scalar>::MicroTriangle *
+RendererT<Scalar>::microTriangle(size_t chunk, uint32_t entry) const
+{
+  if ( !(entry & MICRO_TRIANGLE) )
+    return 0;
+  return &m_micro[chunk][entry & ~MICRO_TRIANGLE];
+}
+
+template <typename Scalar>
+PixelRect RendererT<Scalar>::tileRect(size_t tile) const
+{
+  const int tx = int(tile) % m_tilesX;
+  const int ty = int(tile) / m_tilesX;
+  return PixelRect(tx*TILE_SIZE, ty*TILE_SIZE,
+                   std::min((tx+1)*TILE_SIZE, m_width) - 1,
+                   std::min((ty+1)*TILE_SIZE, m_height) - 1);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::rasterTile(size_t tile)
+{
+  const PixelRect rect = tileRect(tile);
+
+  // clear the part of the buffers owned by this tile
+  if ( m_clearTiles )
+  {
+    m_depthBuffer.clear(rect);
+    for ( int y=rect.y0; y <= rect.y1; y++ )
+    {
+      std::fill(&m_colorBuffer[size_t(m_height-y-1)*m_width+rect.x0],
+                &m_colorBuffer[size_t(m_height-y-1)*m_width+rect.x1]+1, CLEAR_COLOR);
+      if ( m_shadingMode != SHADING_DIRECT )
+        std::fill(&m_triangleIds[size_t(y)*m_width+rect.x0],
+                  &m_triangleIds[size_t(y)*m_width+rect.x1]+1, NO_TRIANGLE);
+    }
+  }
+
+  switch ( m_shadingMode )
+  {
+    case SHADING_DIRECT:
+      rasterDirect(tile, rect);
+      break;
+    case SHADING_DEFERRED:
+      rasterVisibility(tile, rect);
+      break;
+    case SHADING_DEPTH_PREPASS:
+      rasterPrepass(tile, rect);
+      break;
+  }
+
+  // the last pass over the tile sees the final depth
+  m_tileStats[tile].covered = m_depthBuffer.covered(rect);
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::rasterDirect(size_t tile, const PixelRect &rect)
+{
+  // the SIMD kernel only handles float rows
+  const RasterSIMD::Level simd = m_stats.simd;
+  float *depth_rows = m_depthBuffer.floatRows();
+  const size_t depth_pitch = m_depthBuffer.floatPitch();
+  size_t shaded = 0;
+
+  // process triangles in submission order, chunk by chunk
+  for ( size_t c=0; c < m_bins.size(); c++ )
+  {
+    const FrameVector<uint32_t> &bin = m_bins[c][tile];
+    for ( size_t i=0; i < bin.size(); i++ )
+    {
+      const MicroTriangle *micro = microTriangle(c, bin[i]);
+      const Triangle &t = m_triangles[micro ? micro->triangle : bin[i]];
+      if ( !micro && simd != RasterSIMD::LEVEL_NONE
+        && rasterSIMD(simd, t, m_width, m_height, rect,
+                      depth_rows, depth_pitch, &m_colorBuffer[0], shaded,
+                      RasterSIMD::PASS_DIRECT) )
+        continue;
+
+      DepthTestWriter<Scalar> writer(t, m_depthBuffer, &m_colorBuffer[0], m_width, m_height);
+      if ( micro )
+        micro->raster(writer, rect);
+      else
+        t.raster(writer, m_width, m_height, rect, m_rasterMode);
+      shaded += writer.shaded;
+    }
+  }
+
+  // every fragment passing the depth test was shaded
+  m_tileStats[tile].fragments += shaded;
+  m_tileStats[tile].shaded += shaded;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::rasterPrepass(size_t tile, const PixelRect &rect)
+{
+  const RasterSIMD::Level simd = m_stats.simd;
+  float *depth_rows = m_depthBuffer.floatRows();
+  const size_t depth_pitch = m_depthBuffer.floatPitch();
+
+  // pass 1: depth and triangle ID only, to find the triangle left visible
+  // at each pixel, the same one as in direct shading; a triangle failing
+  // the depth test everywhere is visible nowhere
+  size_t entries = 0;
+  for ( size_t c=0; c < m_bins.size(); c++ )
+    entries += m_bins[c][tile].size();
+  const ArenaAllocator<uint32_t> alloc(&m_arena);
+  FrameVector<std::pair<uint32_t, uint32_t> > survivors(alloc); // chunk, bin entry
+  survivors.reserve(entries);
+  size_t fragments = 0;
+  for ( size_t c=0; c < m_bins.size(); c++ )
+  {
+    const FrameVector<uint32_t> &bin = m_bins[c][tile];
+    for ( size_t i=0; i < bin.size(); i++ )
+    {
+      const MicroTriangle *micro = microTriangle(c, bin[i]);
+      const uint32_t id = micro ? micro->triangle : bin[i];
+      const Triangle &t = m_triangles[id];
+      size_t passed = 0;
+      if ( micro || simd == RasterSIMD::LEVEL_NONE
+        || !rasterSIMD(simd, t, m_width, m_height, rect, depth_rows, depth_pitch,
+                       &m_colorBuffer[0], passed, RasterSIMD::PASS_DEPTH,
+                       &m_triangleIds[0], id) )
+      {
+        DepthWriter<Scalar> writer(t, id, m_depthBuffer, &m_triangleIds[0], m_width);
+        if ( micro )
+          micro->raster(writer, rect);
+        else
+          t.raster(writer, m_width, m_height, rect, m_rasterMode);
+        passed = writer.fragments;
+      }
+      if ( passed )
+        survivors.push_back(std::make_pair(uint32_t(c), bin[i]));
+      fragments += passed;
+    }
+  }
+
+  // pass 2: the same rasterizer again, shading only where the triangle is
+  // visible, so each covered pixel once
+  size_t shaded = 0;
+  for ( size_t i=0; i < survivors.size(); i++ )
+  {
+    const MicroTriangle *micro = microTriangle(survivors[i].first, survivors[i].second);
+    const uint32_t id = micro ? micro->triangle : survivors[i].second;
+    const Triangle &t = m_triangles[id];
+    if ( !micro && simd != RasterSIMD::LEVEL_NONE
+      && rasterSIMD(simd, t, m_width, m_height, rect, depth_rows, depth_pitch,
+                    &m_colorBuffer[0], shaded, RasterSIMD::PASS_VISIBLE,
+                    &m_triangleIds[0], id) )
+      continue;
+
+    VisibleWriter<Scalar> writer(t, id, &m_triangleIds[0], &m_colorBuffer[0],
+                                 m_width, m_height);
+    if ( micro )
+      micro->raster(writer, rect);
+    else
+      t.raster(writer, m_width, m_height, rect, m_rasterMode);
+    shaded += writer.shaded;
+  }
+
+  m_tileStats[tile].fragments += fragments;
+  m_tileStats[tile].shaded += shaded;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::rasterVisibility(size_t tile, const PixelRect &rect)
+{
+  // find the nearest triangle of each pixel
+  size_t fragments = 0;
+  for ( size_t c=0; c < m_bins.size(); c++ )
+  {
+    const FrameVector<uint32_t> &bin = m_bins[c][tile];
+    for ( size_t i=0; i < bin.size(); i++ )
+    {
+      const MicroTriangle *micro = microTriangle(c, bin[i]);
+      const uint32_t id = micro ? micro->triangle : bin[i];
+      const Triangle &t = m_triangles[id];
+      VisibilityWriter<Scalar> writer(t, id, m_depthBuffer, &m_triangleIds[0],
+                              &m_barycentrics[0], m_width);
+      if ( micro )
+        micro->raster(writer, rect);
+      else
+        t.raster(writer, m_width, m_height, rect, m_rasterMode);
+      fragments += writer.fragments;
+    }
+  }
+
+  m_tileStats[tile].fragments += fragments;
+}
+
+template <typename Scalar>
+void RendererT<Scalar>::resolveTile(size_t tile)
+{
+  const PixelRect rect = tileRect(tile);
+
+  // shade each covered pixel once
+  size_t shaded = 0;
+  for ( int y=rect.y0; y <= rect.y1; y++ )
+  {
+    uint32_t *color = &m_colorBuffer[size_t(m_height-y-1)*m_width];
+    for ( int x=rect.x0; x <= rect.x1; x++ )
+    {
+      const size_t i = size_t(y)*m_width+x;
+      if ( m_triangleIds[i] == NO_TRIANGLE )
+        continue;
+
+      const Scalar t0 = m_barycentrics[2*i];
+      const Scalar t1 = m_barycentrics[2*i+1];
+      color[x] = m_triangles[m_triangleIds[i]].getColor(Vector3(t0, t1, Scalar(1)-t0-t1));
+      shaded++;
+    }
+  }
+
+  m_tileStats[tile].shaded += shaded;
+}
+
+template class RendererT<float>;
+template class RendererT<double>;
@@ -0,0 +1,317 @@
+#ifndef __RENDERER_HPP__
+#define __RENDERER_HPP__
+
+#include <vector>
+#include <stdint.h>
+#include "Model.hpp"
+#include "ThreadPool.hpp"
+#include "RasterSIMD.hpp"
+#include "DepthBuffer.hpp"
+#include "HiZBuffer.hpp"
+#include "ScanlineZBuffer.hpp"
+#include "FrameArena.hpp"
+
+/// Per-frame statistics of the software pipeline
+struct RenderStats {
+  size_t threads;    ///< number of threads used
+  RasterSIMD::Level simd; ///< instruction set of the raster stage
+  Model::GeometryStats geometry; ///< triangles read, outside and culled
+  size_t triangles;  ///< triangles handed to the raster stage
+  size_t tiles;      ///< number of screen tiles
+  size_t binned;     ///< triangle references over all tile bins
+  size_t micro;      ///< triangles sampled or dropped while binned, see microFraction()
+  size_t fragments;  ///< fragments passing the depth test
+  size_t shaded;     ///< calls to the shading function
+  size_t covered;    ///< pixels covered in the final image
+  size_t nodesTested;     ///< BVH nodes tested against the Z pyramid
+  size_t nodesCulled;     ///< BVH nodes found hidden or off screen
+  size_t trianglesCulled; ///< triangles below the culled nodes
+  double geometryMs; ///< transform and filtering time
+  double binningMs;  ///< binning time
+  double rasterMs;   ///< raster, depth test and shading time
+  double occlusionMs;   ///< Z pyramid and BVH culling time
+  double sortMs;     ///< front to back sort time
+  double totalMs;    ///< whole frame time
+  bool reused;       ///< every stage skipped, the last image still held
+  size_t arenaBytes;  ///< frame arena memory used
+  size_t allocations; ///< heap allocations of the frame, with COUNT_ALLOCATIONS
+
+  RenderStats();
+
+  /** \brief How many times fewer shading calls than depth test passes.
+   */
+  double shadingReduction() const;
+  /** \brief Overdraw left in the frame: fragments passing the depth test
+   * but overwritten by nearer ones later, shaded in vain in
+   * SHADING_DIRECT. Front to back ordering lowers it; how many shading
+   * calls that saves takes an unsorted frame to compare with.
+   */
+  size_t overdraw() const;
+  /** \brief Fraction of the triangles that took the micro triangle path,
+   * sampled at one or two pixel centers or dropped while binned.
+   */
+  double microFraction() const;
+};
+
+/// Options and constants shared by renderers of any precision
+class RendererBase {
+public:
+  static const int TILE_SIZE = 64;
+  static const uint32_t CLEAR_COLOR = 0xff808080;
+  static const uint32_t NO_TRIANGLE = 0xffffffff;
+  /// Flag of the tile bin entries indexing the micro triangles of a chunk
+  static const uint32_t MICRO_TRIANGLE = 0x80000000;
+  static const double OCCLUDER_FRACTION;
+  /// Bits of the depth keys of the front to back sort, a multiple of 8
+  static const int SORT_KEY_BITS = 16;
+
+  enum ShadingMode {
+    SHADING_DIRECT,       ///< shade each fragment passing the depth test
+    SHADING_DEFERRED,     ///< shade each pixel once, from a visibility buffer
+    SHADING_DEPTH_PREPASS ///< write depth first, then shade the visible triangles
+  };
+  static const char *shadingModeName(ShadingMode mode);
+
+  enum Engine {
+    ENGINE_TILED,    ///< tile binned Z-Buffer with a full frame depth buffer
+    ENGINE_SCANLINE, ///< scan-line Z-Buffer with a one scanline depth buffer
+    ENGINE_INTERVAL  ///< interval scan-line, visibility resolved per span
+  };
+  static const char *engineName(Engine engine);
+};
+
+/** \brief Software Z-Buffer renderer.
+ *
+ * The geometry stage runs Model::getTriangles on the renderer's thread
+ * pool. Its triangles are sorted into screen tiles of
+ * TILE_SIZE*TILE_SIZE pixels. Each tile is then rastered by exactly one
+ * thread, which processes its triangles in submission order, so no locks
+ * are needed on the buffers and the image does not depend on the number
+ * of threads.
+ *
+ * In SHADING_DIRECT mode each fragment passing the depth test is shaded
+ * at once. In SHADING_DEFERRED mode the raster stage only writes depth,
+ * triangle ID and barycentrics into a visibility buffer, and a second
+ * pass over each tile shades every covered pixel exactly once. In
+ * SHADING_DEPTH_PREPASS mode each tile is rastered twice: first writing
+ * depth and triangle ID only, then shading only the pixels where the
+ * triangle was left visible. The SIMD kernel shades as it goes, so it does not apply
+ * to SHADING_DEFERRED.
+ *
+ * With occlusion culling, the nearest OCCLUDER_FRACTION of the BVH leaves
+ * of the model are rendered first. A hierarchical Z pyramid is then built
+ * over the depth buffer, and BVH nodes whose projected box lies behind it
+ * are skipped before their triangles are transformed.
+ *
+ * Vertices are snapped to 1/SUBPIXEL_SCALE of a pixel, and pixels on
+ * edges shared by two triangles are drawn by exactly one of them.
+ * Triangles reaching no pixel center are dropped while binned. In
+ * RASTER_EDGE_FUNCTION mode, triangles whose bounds hold at most two
+ * pixel centers are sampled there as well, from the vertices snapped for
+ * their bounds, and only the covered centers are binned; the raster
+ * stage visits those without setting the triangle up again. The other
+ * raster modes raster every triangle the same way.
+ *
+ * With front to back ordering, the triangles of each pass are sorted by
+ * the view space depth of their centroids before they are binned, so that
+ * nearer surfaces reach the depth buffer first and hidden fragments fail
+ * the depth test instead of being shaded and overwritten. ENGINE_INTERVAL
+ * does no depth test and is left unsorted.
+ *
+ * ENGINE_SCANLINE replaces the tiled back end by a single threaded
+ * scan-line Z-Buffer, which keeps depth for one scanline only, and
+ * ENGINE_INTERVAL by an interval scan-line algorithm, which keeps no depth
+ * at all. Shading mode, SIMD level and occlusion culling only apply to
+ * ENGINE_TILED.
+ *
+ * The model's vertex cache keeps view space normals when the camera only
+ * zooms, and view space positions when only the projection changes. A
+ * frame whose inputs did not change at all is not rendered again.
+ *
+ * Triangles, tile bins and work lists of a frame are drawn from a
+ * FrameArena, which is reset at the start of the next frame. Once it has
+ * grown to the size of the scene, frames allocate nothing from the heap.
+ *
+ * Geometry, raster and shading run in precision Scalar. RendererT<float>,
+ * or Renderer, is the one to use; RendererT<double> renders reference
+ * images and has no SIMD kernel.
+ */
+template <typename Scalar>
+class RendererT : public RendererBase, public EigenTypesT<Scalar> {
+public:
+  typedef typename EigenTypesT<Scalar>::Vector3 Vector3;
+  typedef typename EigenTypesT<Scalar>::Vector4 Vector4;
+  typedef typename EigenTypesT<Scalar>::Matrix4 Matrix4;
+  typedef TriangleT<Scalar> Triangle;
+  typedef FrameVector<Triangle> TriangleList;
+
+public:
+  RendererT();
+  ~RendererT();
+
+public:
+  void setEngine(Engine engine);
+  Engine engine() const;
+  void setRasterMode(TriangleBase::RasterMode mode);
+  TriangleBase::RasterMode rasterMode() const;
+  /** \brief Use the SIMD raster kernel up to level, clamped to the host.
+   *
+   * With LEVEL_NONE the scalar rasterizer of rasterMode() is used.
+   */
+  void setSimdLevel(RasterSIMD::Level level);
+  RasterSIMD::Level simdLevel() const;
+  void setShadingMode(ShadingMode mode);
+  ShadingMode shadingMode() const;
+  /** \brief Storage of the depth buffer; the SIMD kernel needs
+   * FORMAT_FLOAT32 in LAYOUT_ROW_MAJOR and is skipped otherwise.
+   */
+  void setDepthFormat(DepthBuffer::Format format);
+  DepthBuffer::Format depthFormat() const;
+  void setDepthLayout(DepthBuffer::Layout layout);
+  DepthBuffer::Layout depthLayout() const;
+  /** \brief Bytes held by the depth buffer.
+   */
+  size_t depthBytes() const;
+  /** \brief Which faces the geometry stage drops, CULL_BACK by default.
+   */
+  void setCullMode(Model::CullMode mode);
+  Model::CullMode cullMode() const;
+  void setOcclusionCulling(bool enabled);
+  bool occlusionCulling() const;
+  /** \brief Sort the triangles front to back before rastering them.
+   */
+  void setFrontToBack(bool enabled);
+  bool frontToBack() const;
+  /** \brief Use numThreads threads, or one per core if 0.
+   */
+  void setNumThreads(size_t numThreads);
+  size_t numThreads() const;
+
+  /** \brief Render model into a width*height image, seen through
+   * modelView and projection; lighting happens in view space.
+   *
+   * If neither the arguments nor any setting changed since the last frame,
+   * its image is kept and RenderStats::reused is set; the other counters
+   * are the ones of that frame.
+   */
+  void render(Model &model, const Matrix4 &modelView, const Matrix4 &projection,
+              int width, int height);
+  /** \brief Render the next frame in full, as needed after changing the
+   * model passed to render().
+   */
+  void invalidate();
+
+  int width() const;
+  int height() const;
+  /** \brief ARGB32 pixels of the last frame, top row first.
+   */
+  const uint32_t *colorBuffer() const;
+  const RenderStats &stats() const;
+
+private:
+  /// Pixel centers a micro triangle covers, found while binned
+  struct MicroTriangle {
+    uint32_t triangle; ///< index into the triangle list
+    int count;         ///< covered centers, at most two
+    int x[2], y[2];
+    Vector3 t[2];      ///< barycentric coordinates of each center
+
+    template <typename Visitor>
+    void raster(Visitor &visit, const PixelRect &clip) const
+    {
+      for ( int i=0; i < count; i++ )
+        if ( x[i] >= clip.x0 && x[i] <= clip.x1 && y[i] >= clip.y0 && y[i] <= clip.y1 )
+          visit(x[i], y[i], t[i]);
+    }
+  };
+
+  void resize(int width, int height);
+  /** \brief Start a frame: empty the containers in the arena and reset it.
+   */
+  void resetArena();
+  void renderScanline(Model &model, const Matrix4 &modelView, const Matrix4 &projection);
+  /** \brief Bin and raster the triangles from first on, clearing the
+   * buffers before if clear is set.
+   */
+  void rasterPass(size_t first, bool clear);
+  void renderOccluded(Model &model, const Matrix4 &modelView, const Matrix4 &projection);
+  /** \brief Stable radix sort of the triangles from first on by
+   * quantized view space depth, nearest first.
+   */
+  void sortTriangles(size_t first);
+  void binTriangles(size_t chunk);
+  /** \brief Micro triangle of a bin entry of chunk, or 0 if the entry is a
+   * triangle index.
+   */
+  const MicroTriangle *microTriangle(size_t chunk, uint32_t entry) const;
+  PixelRect tileRect(size_t tile) const;
+  void rasterTile(size_t tile);
+  void rasterDirect(size_t tile, const PixelRect &rect);
+  void rasterPrepass(size_t tile, const PixelRect &rect);
+  void rasterVisibility(size_t tile, const PixelRect &rect);
+  void resolveTile(size_t tile);
+
+private:
+  /// Counters of a tile, summed up into RenderStats after the raster stage
+  struct TileStats {
+    size_t fragments;
+    size_t shaded;
+    size_t covered; ///< set by the last pass over the tile
+
+    TileStats()
+      : fragments(0), shaded(0), covered(0)
+    {}
+  };
+
+  Engine m_engine;
+  TriangleBase::RasterMode m_rasterMode;
+  RasterSIMD::Level m_simdLevel;
+  ShadingMode m_shadingMode;
+  Model::CullMode m_cullMode;
+  bool m_occlusionCulling;
+  bool m_frontToBack;
+  ThreadPool *m_pool;
+
+  int m_width;
+  int m_height;
+  int m_tilesX;
+  int m_tilesY;
+  std::vector<uint32_t> m_colorBuffer;
+  DepthBuffer m_depthBuffer;
+  /// visibility buffer: nearest triangle and its first two barycentrics;
+  /// the depth pre-pass keeps the triangle IDs only
+  std::vector<uint32_t> m_triangleIds;
+  std::vector<float> m_barycentrics;
+
+  /// memory of the frame, declared before the containers drawing from it
+  FrameArena m_arena;
+  TriangleList m_triangles;
+  /// tile bins of each chunk of triangles, indexed [chunk][tile]
+  std::vector<std::vector<FrameVector<uint32_t> > > m_bins;
+  /// micro triangles of each chunk, indexed by the tile bin entries
+  std::vector<FrameVector<MicroTriangle> > m_micro;
+  /// micro triangles found by each chunk of the binning stage
+  std::vector<size_t> m_binMicro;
+  std::vector<TileStats> m_tileStats;
+  size_t m_binFirst;
+  bool m_clearTiles;
+
+  HiZBuffer m_hiz;
+  /// BVH leaves rendered as occluders, indexed [shape][node]
+  std::vector<std::vector<uint8_t> > m_occluders;
+
+  ScanlineZBufferT<Scalar> m_scanline;
+
+  RenderStats m_stats;
+
+  /// inputs of the last frame, which stays valid until a setting changes
+  bool m_frameValid;
+  const Model *m_lastModel;
+  Matrix4 m_lastModelView;
+  Matrix4 m_lastProjection;
+
+};
+
+typedef RendererT<float> Renderer;
+
+#endif //__RENDERER_HPP__
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "ScanlineZBuffer.hpp"
+
+namespace {
+
+/// floor(n / d) for d > 0
+inline int64_t floorDiv(int64_t n, int64_t d)
+{
+  return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+/// ceil(n / d) for d > 0
+inline int64_t ceilDiv(int64_t n, int64_t d)
+{
+  return n >= 0 ? (n + d - 1) / d : -(-n / d);
+}
+
+/** \brief Bucket the indices of items by their first scanline, keeping
+ * their order: row y holds table[start[y]] to table[start[y+1]-1].
+ */
+template <typename Item>
+void bucketRows(const FrameVector<Item> &items, int height,
+                FrameVector<uint32_t> &start, FrameVector<uint32_t> &table)
+{
+  start.assign(height+1, 0);
+  for ( size_t i=0; i < items.size(); i++ )
+    start[items[i].y_start+1]++;
+  for ( int y=0; y < height; y++ )
+    start[y+1] += start[y];
+
+  // fill each row from its start, which leaves start[y] at start[y+1]
+  table.resize(items.size());
+  for ( size_t i=0; i < items.size(); i++ )
+    table[start[items[i].y_start]++] = uint32_t(i);
+  for ( int y=height; y > 0; y-- )
+    start[y] = start[y-1];
+  start[0] = 0;
+}
+
+}
+
+template <typename Scalar>
+ScanlineZBufferT<Scalar>::ScanlineZBufferT()
+  : m_fragments(0), m_shaded(0), m_covered(0)
+{
+}
+
+template <typename Scalar>
+size_t ScanlineZBufferT<Scalar>::fragments() const
+{
+  return m_fragments;
+}
+
+template <typename Scalar>
+size_t ScanlineZBufferT<Scalar>::shaded() const
+{
+  return m_shaded;
+}
+
+template <typename Scalar>
+size_t ScanlineZBufferT<Scalar>::covered() const
+{
+  return m_covered;
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::addEdge(uint32_t polygon, const EdgeFunctions &edges, size_t k,
+                                       int ya, int yb, int height)
+{
+  if ( ya > yb )
+    std::swap(ya, yb);
+
+  // scanlines are sampled at their centers, like pixels
+  const int64_t scale = Triangle::SUBPIXEL_SCALE;
+  const int first = int(ceilDiv(ya - scale / 2, scale));
+  const int last = int(floorDiv(yb - scale / 2, scale));
+  if ( first > last || last < 0 || first >= height )
+    return;
+
+  Edge e;
+  e.polygon = polygon;
+  e.y_start = std::max(first, 0);
+  e.y_end = std::min(last, height-1);
+  e.a = edges.a[k];
+  e.b = edges.b[k];
+  e.e = edges.b[k] * e.y_start + edges.c[k];
+  m_edges.push_back(e);
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::classify(const TriangleList &triangles, int width, int height)
+{
+  m_polygons.reserve(triangles.size());
+  m_edges.reserve(3 * triangles.size());
+
+  const PixelRect screen(0, 0, width-1, height-1);
+  for ( size_t i=0; i < triangles.size(); i++ )
+  {
+    Polygon p;
+    if ( !triangles[i].setupEdges(p.edges, width, height) )
+      continue;
+    const PixelRect r = p.edges.bounds.intersected(screen);
+    if ( r.empty() )
+      continue;
+
+    p.triangle = uint32_t(i);
+    p.y_start = r.y0;
+    p.y_end = r.y1;
+    const uint32_t polygon = uint32_t(m_polygons.size());
+    m_polygons.push_back(p);
+
+    // edge k runs between vertices k+1 and k+2
+    int xd[3];
+    int yd[3];
+    triangles[i].snap(xd, yd, width, height);
+    for ( size_t k=0; k < 3; k++ )
+      addEdge(polygon, p.edges, k, yd[(k+1)%3], yd[(k+2)%3], height);
+  }
+
+  bucketRows(m_polygons, height, m_polygonStart, m_polygonTable);
+  bucketRows(m_edges, height, m_edgeStart, m_edgeTable);
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::render(const TriangleList &triangles, int width, int height,
+                                      uint32_t *color, uint32_t clear_color, Visibility visibility)
+{
+  m_fragments = 0;
+  m_shaded = 0;
+  m_covered = 0;
+
+  // the lists of the last frame were freed with their arena
+  const ArenaAllocator<uint32_t> alloc = triangles.get_allocator();
+  m_polygons = FrameVector<Polygon>(alloc);
+  m_edges = FrameVector<Edge>(alloc);
+  m_polygonTable = FrameVector<uint32_t>(alloc);
+  m_polygonStart = FrameVector<uint32_t>(alloc);
+  m_edgeTable = FrameVector<uint32_t>(alloc);
+  m_edgeStart = FrameVector<uint32_t>(alloc);
+  m_activePolygons = FrameVector<uint32_t>(alloc);
+  m_merged = FrameVector<uint32_t>(alloc);
+  m_activeEdges = FrameVector<uint32_t>(alloc);
+  m_spans = FrameVector<Span>(alloc);
+  m_events = FrameVector<Event>(alloc);
+  m_inside = FrameVector<uint32_t>(alloc);
+  if ( visibility == VISIBILITY_ZBUFFER )
+    m_depth.resize(width);
+
+  classify(triangles, width, height);
+
+  for ( int y=0; y < height; y++ )
+  {
+    // polygons and edges starting on this scanline become active; the
+    // polygon table is in submission order, so a merge keeps it that way
+    if ( m_polygonStart[y] != m_polygonStart[y+1] )
+    {
+      m_merged.resize(m_activePolygons.size() + m_polygonStart[y+1] - m_polygonStart[y]);
+      std::merge(m_activePolygons.begin(), m_activePolygons.end(),
+                 m_polygonTable.begin() + m_polygonStart[y],
+                 m_polygonTable.begin() + m_polygonStart[y+1], m_merged.begin());
+      m_activePolygons.swap(m_merged);
+    }
+    m_activeEdges.insert(m_activeEdges.end(), m_edgeTable.begin() + m_edgeStart[y],
+                         m_edgeTable.begin() + m_edgeStart[y+1]);
+
+    // each active polygon spans the pixels of its bounds on the inner
+    // side of all its active edges: edges with the inside to the right
+    // bound the span on the left, and the other way round
+    for ( size_t i=0; i < m_activePolygons.size(); i++ )
+    {
+      Polygon &p = m_polygons[m_activePolygons[i]];
+      p.span_lo = p.edges.bounds.x0;
+      p.span_hi = p.edges.bounds.x1;
+    }
+    for ( size_t i=0; i < m_activeEdges.size(); i++ )
+    {
+      const Edge &e = m_edges[m_activeEdges[i]];
+      Polygon &p = m_polygons[e.polygon];
+      if ( e.a > 0 )
+        p.span_lo = std::max(p.span_lo, ceilDiv(-e.e, e.a));
+      else if ( e.a < 0 )
+        p.span_hi = std::min(p.span_hi, floorDiv(e.e, -e.a));
+      else if ( e.e < 0 )
+        p.span_hi = std::numeric_limits<int64_t>::min();
+    }
+
+    uint32_t *row = color + size_t(height-y-1) * width;
+    std::fill(row, row + width, clear_color);
+    if ( visibility == VISIBILITY_ZBUFFER )
+      depthTestSpans(triangles, y, width, row);
+    else
+      resolveIntervals(triangles, y, width, row);
+
+    // retire what ends on this scanline and step the remaining edges
+    size_t n = 0;
+    for ( size_t i=0; i < m_activePolygons.size(); i++ )
+      if ( m_polygons[m_activePolygons[i]].y_end > y )
+        m_activePolygons[n++] = m_activePolygons[i];
+    m_activePolygons.resize(n);
+
+    n = 0;
+    for ( size_t i=0; i < m_activeEdges.size(); i++ )
+    {
+      Edge &e = m_edges[m_activeEdges[i]];
+      if ( e.y_end > y )
+      {
+        e.e += e.b;
+        m_activeEdges[n++] = m_activeEdges[i];
+      }
+    }
+    m_activeEdges.resize(n);
+  }
+
+  // every fragment passing the depth test was shaded, and intervals
+  // shade each covered pixel once
+  m_fragments = m_shaded;
+  if ( visibility == VISIBILITY_INTERVAL )
+    m_covered = m_shaded;
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::depthTestSpans(const TriangleList &triangles, int y, int width,
+                                              uint32_t *row)
+{
+  std::fill(m_depth.begin(), m_depth.end(), 1.0f);
+
+  for ( size_t i=0; i < m_activePolygons.size(); i++ )
+  {
+    const Polygon &p = m_polygons[m_activePolygons[i]];
+    const int x0 = int(std::max<int64_t>(p.span_lo, 0));
+    const int x1 = int(std::min<int64_t>(p.span_hi, width-1));
+    if ( x0 > x1 )
+      continue;
+
+    // barycentrics step by a constant along the span
+    const Triangle &t = triangles[p.triangle];
+    const int64_t *a = p.edges.a;
+    int64_t e0 = p.edges.at(0, x0, y);
+    int64_t e1 = p.edges.at(1, x0, y);
+    int64_t e2 = p.edges.at(2, x0, y);
+    const Scalar inv_area = Scalar(1) / p.edges.area;
+    for ( int x=x0; x <= x1; x++ )
+    {
+      const Vector3 bc(e0*inv_area, e1*inv_area, e2*inv_area);
+      const float d = t.getDepth(bc);
+      if ( d < m_depth[x] )
+      {
+        m_depth[x] = d;
+        row[x] = t.getColor(bc);
+        m_shaded++;
+      }
+      e0 += a[0];
+      e1 += a[1];
+      e2 += a[2];
+    }
+  }
+
+  for ( int x=0; x < width; x++ )
+    m_covered += m_depth[x] < 1.0f;
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::resolveIntervals(const TriangleList &triangles, int y, int width,
+                                                uint32_t *row)
+{
+  // depth is linear along the scanline, d(x) = d0 + dd * x
+  m_spans.clear();
+  m_events.clear();
+  for ( size_t i=0; i < m_activePolygons.size(); i++ )
+  {
+    const Polygon &p = m_polygons[m_activePolygons[i]];
+    Span s;
+    s.polygon = m_activePolygons[i];
+    s.x0 = int(std::max<int64_t>(p.span_lo, 0));
+    s.x1 = int(std::min<int64_t>(p.span_hi, width-1));
+    if ( s.x0 > s.x1 )
+      continue;
+
+    const Triangle &t = triangles[p.triangle];
+    const double inv_area = 1.0 / p.edges.area;
+    s.d0 = 0.0;
+    s.dd = 0.0;
+    for ( size_t k=0; k < 3; k++ )
+    {
+      const double z = double(t.vertices[k].z()) * inv_area;
+      s.d0 += z * double(p.edges.b[k] * y + p.edges.c[k]);
+      s.dd += z * double(p.edges.a[k]);
+    }
+
+    const uint32_t span = uint32_t(m_spans.size());
+    m_spans.push_back(s);
+    m_events.push_back(Event());
+    m_events.back().x = s.x0;
+    m_events.back().span = span;
+    m_events.back().enter = true;
+    m_events.push_back(Event());
+    m_events.back().x = s.x1 + 1;
+    m_events.back().span = span;
+    m_events.back().enter = false;
+  }
+  std::sort(m_events.begin(), m_events.end());
+
+  // sweep the intervals between span ends; the spans over an interval are
+  // kept in submission order, so the first one wins a depth tie
+  m_inside.clear();
+  for ( size_t i=0; i < m_events.size(); )
+  {
+    const int x = m_events[i].x;
+    for ( ; i < m_events.size() && m_events[i].x == x; i++ )
+    {
+      const uint32_t span = m_events[i].span;
+      FrameVector<uint32_t>::iterator it = std::lower_bound(m_inside.begin(), m_inside.end(), span);
+      if ( m_events[i].enter )
+        m_inside.insert(it, span);
+      else
+        m_inside.erase(it);
+    }
+    if ( i < m_events.size() && !m_inside.empty() )
+      resolveInterval(triangles, y, x, m_events[i].x - 1, row);
+  }
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::resolveInterval(const TriangleList &triangles, int y,
+                                               int x0, int x1, uint32_t *row)
+{
+  // the background is a plane at the far depth, which fragments must beat
+  int nearest[2] = {-1, -1};
+  double depth[2] = {1.0, 1.0};
+  const int x[2] = {x0, x1};
+  for ( size_t i=0; i < m_inside.size(); i++ )
+  {
+    const Span &s = m_spans[m_inside[i]];
+    for ( size_t k=0; k < 2; k++ )
+    {
+      const double d = s.d0 + s.dd * x[k];
+      if ( d < depth[k] )
+      {
+        depth[k] = d;
+        nearest[k] = int(m_inside[i]);
+      }
+    }
+  }
+
+  // nearest at both ends means nearest over the whole interval, since all
+  // depths are linear
+  if ( nearest[0] == nearest[1] )
+  {
+    if ( nearest[0] >= 0 )
+    {
+      const Polygon &p = m_polygons[m_spans[nearest[0]].polygon];
+      fillSpan(triangles[p.triangle], p, y, x0, x1, row);
+    }
+    return;
+  }
+
+  // otherwise split where the two planes intersect
+  double d0[2], dd[2];
+  for ( size_t k=0; k < 2; k++ )
+  {
+    d0[k] = nearest[k] >= 0 ? m_spans[nearest[k]].d0 : 1.0;
+    dd[k] = nearest[k] >= 0 ? m_spans[nearest[k]].dd : 0.0;
+  }
+  int split = x0 + (x1 - x0) / 2;
+  if ( dd[0] != dd[1] )
+  {
+    const double xs = std::floor((d0[1] - d0[0]) / (dd[0] - dd[1]));
+    if ( std::isfinite(xs) )
+      split = int(std::max(double(x0), std::min(double(x1 - 1), xs)));
+  }
+  resolveInterval(triangles, y, x0, split, row);
+  resolveInterval(triangles, y, split + 1, x1, row);
+}
+
+template <typename Scalar>
+void ScanlineZBufferT<Scalar>::fillSpan(const Triangle &t, const Polygon &p, int y, int x0, int x1,
+                                        uint32_t *row)
+{
+  const int64_t *a = p.edges.a;
+  int64_t e0 = p.edges.at(0, x0, y);
+  int64_t e1 = p.edges.at(1, x0, y);
+  int64_t e2 = p.edges.at(2, x0, y);
+  const Scalar inv_area = Scalar(1) / p.edges.area;
+  for ( int x=x0; x <= x1; x++ )
+  {
+    row[x] = t.getColor(Vector3(e0*inv_area, e1*inv_area, e2*inv_area));
+    e0 += a[0];
+    e1 += a[1];
+    e2 += a[2];
+  }
+  m_shaded += x1 - x0 + 1;
+}
+
+template class ScanlineZBufferT<float>;
+template class ScanlineZBufferT<double>;
@@ -0,0 +1,136 @@
+#ifndef __SCANLINE_ZBUFFER_HPP__
+#define __SCANLINE_ZBUFFER_HPP__
+
+#include <vector>
+#include <stdint.h>
+#include "Model.hpp"
+#include "FrameArena.hpp"
+
+/** \brief Scan-line hidden surface removal.
+ *
+ * Triangles are entered into a classified polygon table and a classified
+ * edge table, both bucketed by the scanline they start on. Walking the
+ * image bottom up, the active polygon and active edge lists are updated
+ * incrementally and the x intersections of active edges are stepped by a
+ * constant per scanline. Visibility on a scanline is then resolved by
+ *
+ *  - VISIBILITY_ZBUFFER: depth testing each active polygon's span against
+ *    a depth buffer of a single scanline;
+ *  - VISIBILITY_INTERVAL: splitting the scanline at the span ends into
+ *    intervals covered by a fixed set of polygons, and comparing their
+ *    depth planes at the interval ends. If different polygons are nearest
+ *    at the two ends, they penetrate or overlap in depth, and the interval
+ *    is split at the intersection of their planes. No depth is stored.
+ *
+ * Each edge bounds the spans of its polygon by the same integer edge
+ * function Triangle::raster tests, solved for x, so coverage matches the
+ * edge-function rasterizer, top-left fill rule included. Polygons are
+ * visited in submission order, so depth ties resolve the same way too.
+ * The interval method compares depth planes in double precision, so it
+ * may differ where surfaces intersect.
+ *
+ * The tables and lists of a frame are drawn from the arena of the
+ * triangles' allocator, and are only valid until it is reset.
+ */
+template <typename Scalar>
+class ScanlineZBufferT : public EigenTypesT<Scalar> {
+public:
+  typedef typename EigenTypesT<Scalar>::Vector3 Vector3;
+  typedef TriangleT<Scalar> Triangle;
+  typedef FrameVector<Triangle> TriangleList;
+
+  enum Visibility {
+    VISIBILITY_ZBUFFER, ///< depth test each pixel of a span
+    VISIBILITY_INTERVAL ///< compare depth planes once per interval
+  };
+
+public:
+  ScanlineZBufferT();
+
+public:
+  /** \brief Render triangles into width*height ARGB32 pixels, top row first.
+   */
+  void render(const TriangleList &triangles, int width, int height,
+              uint32_t *color, uint32_t clear_color, Visibility visibility);
+
+  size_t fragments() const; ///< fragments passing the depth test of the last frame
+  size_t shaded() const;    ///< shading calls of the last frame
+  size_t covered() const;   ///< pixels covered in the last frame
+
+private:
+  /// Entry of the classified polygon table
+  struct Polygon {
+    uint32_t triangle;   ///< index into the triangles
+    int y_start;         ///< first scanline
+    int y_end;           ///< last scanline
+    EdgeFunctions edges; ///< for barycentrics and depth along spans
+    int64_t span_lo;     ///< leftmost pixel on the current scanline
+    int64_t span_hi;     ///< rightmost pixel on the current scanline
+  };
+
+  /// Entry of the classified edge table: on a scanline, the polygon
+  /// covers pixels x with a * x + e >= 0
+  struct Edge {
+    uint32_t polygon;
+    int y_start;   ///< first scanline
+    int y_end;     ///< last scanline
+    int64_t a;     ///< step of the edge function per pixel
+    int64_t e;     ///< edge function at x = 0 on the current scanline
+    int64_t b;     ///< added to e per scanline
+  };
+
+  /// Span of an active polygon on the current scanline, with depth d0 + dd * x
+  struct Span {
+    uint32_t polygon;
+    int x0, x1;
+    double d0, dd;
+  };
+
+  /// A span starts (enter) or ends at x
+  struct Event {
+    int x;
+    uint32_t span;
+    bool enter;
+
+    bool operator<(const Event &e) const { return x < e.x; }
+  };
+
+private:
+  void classify(const TriangleList &triangles, int width, int height);
+  /** \brief Enter edge k of a polygon, running between sub-pixel rows
+   * ya and yb, for the scanlines whose centers lie in between.
+   */
+  void addEdge(uint32_t polygon, const EdgeFunctions &edges, size_t k, int ya, int yb,
+               int height);
+  void depthTestSpans(const TriangleList &triangles, int y, int width, uint32_t *row);
+  void resolveIntervals(const TriangleList &triangles, int y, int width, uint32_t *row);
+  /// Fill pixels x0 to x1 with the nearest of the spans in m_inside
+  void resolveInterval(const TriangleList &triangles, int y, int x0, int x1, uint32_t *row);
+  void fillSpan(const Triangle &t, const Polygon &p, int y, int x0, int x1, uint32_t *row);
+
+private:
+  FrameVector<Polygon> m_polygons;
+  FrameVector<Edge> m_edges;
+  /// polygons by first scanline, those of row y from m_polygonStart[y] on
+  FrameVector<uint32_t> m_polygonTable;
+  FrameVector<uint32_t> m_polygonStart;
+  /// edges by first scanline, those of row y from m_edgeStart[y] on
+  FrameVector<uint32_t> m_edgeTable;
+  FrameVector<uint32_t> m_edgeStart;
+  FrameVector<uint32_t> m_activePolygons;             ///< in submission order
+  FrameVector<uint32_t> m_merged;                     ///< merge buffer of m_activePolygons
+  FrameVector<uint32_t> m_activeEdges;
+  std::vector<float> m_depth;                         ///< depth of one scanline
+  FrameVector<Span> m_spans;                          ///< in submission order
+  FrameVector<Event> m_events;
+  FrameVector<uint32_t> m_inside;                     ///< spans over the current interval
+
+  size_t m_fragments;
+  size_t m_shaded;
+  size_t m_covered;
+
+};
+
+typedef ScanlineZBufferT<float> ScanlineZBuffer;
+
+#endif //__SCANLINE_ZBUFFER_HPP__
@@ -0,0 +1,96 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(size_t numThreads)
+  : m_job(0),
+    m_count(0),
+    m_next(0),
+    m_busy(0),
+    m_generation(0),
+    m_quit(false)
+{
+  if ( numThreads == 0 )
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  for ( size_t i=1; i < numThreads; i++ )
+  {
+    m_workers.push_back(std::thread(&ThreadPool::work, this));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+  }
+  m_wakeup.notify_all();
+
+  for ( size_t i=0; i < m_workers.size(); i++ )
+  {
+    m_workers[i].join();
+  }
+}
+
+size_t ThreadPool::numThreads() const
+{
+  return m_workers.size() + 1;
+}
+
+void ThreadPool::run(size_t count, const Job &job)
+{
+  if ( m_workers.empty() || count <= 1 )
+  {
+    for ( size_t i=0; i < count; i++ )
+      job(i);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_job = &job;
+    m_count = count;
+    m_next = 0;
+    m_busy = m_workers.size();
+    m_generation++;
+  }
+  m_wakeup.notify_all();
+
+  drain();
+
+  // wait for the workers to finish their last job
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_finished.wait(lock, [this]{ return m_busy == 0; });
+  m_job = 0;
+}
+
+void ThreadPool::work()
+{
+  size_t generation = 0;
+
+  for ( ;; )
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeup.wait(lock, [&]{ return m_quit || m_generation != generation; });
+      if ( m_quit )
+        return;
+      generation = m_generation;
+    }
+
+    drain();
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busy--;
+    }
+    m_finished.notify_one();
+  }
+}
+
+void ThreadPool::drain()
+{
+  for ( size_t i = m_next++; i < m_count; i = m_next++ )
+  {
+    (*m_job)(i);
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+/** \brief A fixed set of worker threads running parallel loops.
+ *
+ * The calling thread takes part in each loop, so a pool of n threads owns
+ * n-1 workers and a pool of one thread runs everything inline.
+ */
+class ThreadPool {
+public:
+  typedef std::function<void(size_t)> Job;
+
+public:
+  /** \brief Create a pool of numThreads threads, or one per core if 0.
+   */
+  explicit ThreadPool(size_t numThreads=0);
+  ~ThreadPool();
+
+public:
+  size_t numThreads() const;
+
+  /** \brief Call job(i) for each i in [0, count) and wait for all of them.
+   *
+   * Indices are handed out dynamically, so jobs must not depend on which
+   * thread runs them.
+   */
+  void run(size_t count, const Job &job);
+
+private:
+  void work();
+  void drain();
+
+private:
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wakeup;
+  std::condition_variable m_finished;
+
+  const Job *m_job;
+  size_t m_count;
+  std::atomic<size_t> m_next;
+  size_t m_busy;
+  size_t m_generation;
+  bool m_quit;
+
+};
+
+#endif //__THREAD_POOL_HPP__
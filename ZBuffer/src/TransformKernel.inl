@@ -0,0 +1,47 @@
+/* Vectorized vertex transform of RasterSIMD.
+ *
+ * Included by RasterSIMD.cpp next to RasterKernel.inl, once per
+ * instruction set, inside a namespace providing the vector operations V.
+ */
+
+void transform(const float m[16], const float *x, const float *y, const float *z,
+               size_t n, float *out[4])
+{
+  V::F r[16];
+  for ( size_t i=0; i < 16; i++ )
+    r[i] = V::set1(m[i]);
+
+  for ( size_t i=0; i < n; i += V::N )
+  {
+    const V::F vx = V::loadf(x + i);
+    const V::F vy = V::loadf(y + i);
+    const V::F vz = V::loadf(z + i);
+    for ( size_t k=0; k < 4; k++ )
+    {
+      const V::F *row = r + 4*k;
+      V::storef(out[k] + i, V::add(V::add(V::mul(row[0], vx), V::mul(row[1], vy)),
+                                   V::add(V::mul(row[2], vz), row[3])));
+    }
+  }
+}
+
+void transformAffine(const float m[12], const float *x, const float *y, const float *z,
+                     size_t n, float *out[3])
+{
+  V::F r[12];
+  for ( size_t i=0; i < 12; i++ )
+    r[i] = V::set1(m[i]);
+
+  for ( size_t i=0; i < n; i += V::N )
+  {
+    const V::F vx = V::loadf(x + i);
+    const V::F vy = V::loadf(y + i);
+    const V::F vz = V::loadf(z + i);
+    for ( size_t k=0; k < 3; k++ )
+    {
+      const V::F *row = r + 4*k;
+      V::storef(out[k] + i, V::add(V::add(V::mul(row[0], vx), V::mul(row[1], vy)),
+                                   V::add(V::mul(row[2], vz), row[3])));
+    }
+  }
+}
@@ -10,6 +10,7 @@ ZBWidget::ZBWidget(Model *model, QWidget *parent)
     m_cameraAngleY(0.0f),
     m_cameraDistance(3.0f)
 {
+  setFocusPolicy(Qt::StrongFocus);
   connect(this, SIGNAL(repaintNeeded()), this, SLOT(update()));
 }
 
@@ -103,45 +104,22 @@ void ZBWidget::paintEvent(QPaintEvent *event)
   const int width = this->width();
   const int height = this->height();
 
-  QImage img(width, height, QImage::Format_ARGB32);
-  img.fill(Qt::darkGray);
-
-  Eigen::MatrixXd zbuffer(width, height);
-  zbuffer.fill(1.0);
-
-  QRgb *img_data[height];
-  for ( int i=0; i < height; i++ )
-  {
-    img_data[i] = (QRgb*)img.scanLine(i);
-  }
-
-#if 0
-  for ( int i=0; i < height; i++ )
-    for ( int j=0; j < width; j++ )
-    {
-      double d = std::sqrt((i-height/2)*(i-height/2)+(j-width/2)*(j-width/2));
-      if ( d < std::min(height/2, width/2) )
-      {
-        img_data[i][j] = 0xffff0000;
-      }
-    }
-#endif
-
-#if 1
   /* This is how our algorithms work:
    * 0. Setup model matrix
    * 1. Setup view matrix (camera)
    * 2. Setup projection matrix
    * 3. Find out all triangles in the viewing frustum
    * 4. Filter out all triangles facing backward to camera
-   * 5. Rasterize each triangle into pixels
-   * 6. Set each pixel of the image to its nearest triangle pixel's color
+   * 5. Sort triangles into screen tiles
+   * 6. Rasterize each tile into pixels, in parallel
+   * 7. Set each pixel of the image to its nearest triangle pixel's color
    */
-  Matrix4 transform(Matrix4::Identity());
-  transform *= perspective(60.0f, (float)width/height, 1.0f, 1000.0f);
-  transform *= lookAt(0.0f, 0.0f, m_cameraDistance, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
-  transform *= rotateX(m_cameraAngleX);
-  transform *= rotateY(m_cameraAngleY);
+  const Matrix4 projection = perspective(60.0f, (float)width/height, 1.0f, 1000.0f);
+  Matrix4 modelView(Matrix4::Identity());
+  modelView *= lookAt(0.0f, 0.0f, m_cameraDistance, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+  modelView *= rotateX(m_cameraAngleX);
+  modelView *= rotateY(m_cameraAngleY);
+  const Matrix4 transform = projection * modelView;
 
   INFO("transform = (%.2f, %.2f, %.2f, %.2f,\n"
 "                    %.2f, %.2f, %.2f, %.2f,\n"
@@ -152,31 +130,45 @@ void ZBWidget::paintEvent(QPaintEvent *event)
     transform(2,0), transform(2,1), transform(2,2), transform(2,3),
     transform(3,0), transform(3,1), transform(3,2), transform(3,3));
 
-  std::vector<Triangle> triangles;
-  m_model->getTriangles(triangles, transform);
-
-  for ( size_t i=0; i < triangles.size(); i++ )
-  {
-    std::vector<Pixel> pixels;
-    triangles[i].raster(pixels, width, height);
-
-    for ( size_t j=0; j < pixels.size(); j++ )
-    {
-      const Pixel &p = pixels[j];
-      if ( p.x < 0 || p.x >= width
-        || p.y < 0 || p.y >= height )
-        continue;
-
-      float depth = triangles[i].getDepth(p);
-      if ( depth < zbuffer(p.x, p.y) )
-      {
-        zbuffer(p.x, p.y) = depth;
-        img_data[height-p.y-1][p.x] = triangles[i].getColor(p);
-      }
-    }
-  }
-#endif
-
+  m_renderer.render(*m_model, modelView.cast<float>(), projection.cast<float>(), width, height);
+
+  const RenderStats &stats = m_renderer.stats();
+  INFO("frame time: %.2f ms (%s engine, %s, %s, %s shading, %lu threads)", stats.totalMs,
+    Renderer::engineName(m_renderer.engine()),
+    Triangle::rasterModeName(m_renderer.rasterMode()),
+    RasterSIMD::levelName(stats.simd),
+    Renderer::shadingModeName(m_renderer.shadingMode()), stats.threads);
+  INFO("  geometry %.2f ms, binning %.2f ms, raster %.2f ms",
+    stats.geometryMs, stats.binningMs, stats.rasterMs);
+  if ( stats.reused )
+    INFO("  nothing changed, the last frame is reused");
+  INFO("  frustum: %lu/%lu nodes culled, %lu triangles skipped, %lu vertices transformed",
+    stats.geometry.nodesCulled, stats.geometry.nodesTested, stats.geometry.skipped,
+    stats.geometry.vertices);
+  INFO("  vertex cache: normals of %lu, view positions of %lu vertices kept",
+    stats.geometry.normalsReused, stats.geometry.positionsReused);
+  INFO("  normal cones: %lu/%lu meshlets culled, %lu triangles skipped",
+    stats.geometry.meshletsCulled, stats.geometry.meshletsTested,
+    stats.geometry.coneSkipped);
+  INFO("  %s: %lu of %lu triangles culled, %lu outside of the view, %lu clipped",
+    Model::cullModeName(m_renderer.cullMode()), stats.geometry.culled,
+    stats.geometry.assembled, stats.geometry.outside, stats.geometry.clipped);
+  INFO("  %lu triangles, %lu references in %lu tiles, %.1f%% micro triangles",
+    stats.triangles, stats.binned, stats.tiles, 100.0 * stats.microFraction());
+  INFO("  %lu fragments passed depth test, %lu shaded (%.2fx reduction), remaining overdraw %lu",
+    stats.fragments, stats.shaded, stats.shadingReduction(), stats.overdraw());
+  if ( m_renderer.engine() == Renderer::ENGINE_TILED )
+    INFO("  depth buffer: %s, %s, %lu bytes",
+      DepthBuffer::formatName(m_renderer.depthFormat()),
+      DepthBuffer::layoutName(m_renderer.depthLayout()), m_renderer.depthBytes());
+  if ( m_renderer.frontToBack() )
+    INFO("  front to back: triangles sorted in %.2f ms", stats.sortMs);
+  INFO("  frame arena: %lu bytes, %lu heap allocations", stats.arenaBytes, stats.allocations);
+  if ( m_renderer.engine() == Renderer::ENGINE_TILED && m_renderer.occlusionCulling() )
+    INFO("  occlusion %.2f ms: %lu/%lu nodes culled, %lu triangles skipped",
+      stats.occlusionMs, stats.nodesCulled, stats.nodesTested, stats.trianglesCulled);
+
+  QImage img((const uchar*)m_renderer.colorBuffer(), width, height, QImage::Format_ARGB32);
   painter.drawImage(QPoint(), img);
 }
 
@@ -218,3 +210,68 @@ void ZBWidget::mouseReleaseEvent(QMouseEvent *event)
   INFO("processing...");
 }
 
+void ZBWidget::keyPressEvent(QKeyEvent *event)
+{
+  switch ( event->key() )
+  {
+    case Qt::Key_E:
+      // cycle through the back ends
+      m_renderer.setEngine(Renderer::Engine((m_renderer.engine() + 1)
+        % (Renderer::ENGINE_INTERVAL + 1)));
+      emit repaintNeeded();
+      break;
+    case Qt::Key_R:
+      // cycle through the rasterizers, for benchmarking
+      m_renderer.setRasterMode(Triangle::RasterMode((m_renderer.rasterMode() + 1)
+        % (Triangle::RASTER_HIERARCHICAL + 1)));
+      emit repaintNeeded();
+      break;
+    case Qt::Key_V:
+      // switch between scalar and the best SIMD raster kernel
+      m_renderer.setSimdLevel(m_renderer.simdLevel() == RasterSIMD::LEVEL_NONE
+        ? RasterSIMD::LEVEL_AVX2 : RasterSIMD::LEVEL_NONE);
+      emit repaintNeeded();
+      break;
+    case Qt::Key_D:
+      // cycle through direct, deferred and depth pre-pass shading
+      m_renderer.setShadingMode(Renderer::ShadingMode((m_renderer.shadingMode() + 1)
+        % (Renderer::SHADING_DEPTH_PREPASS + 1)));
+      emit repaintNeeded();
+      break;
+    case Qt::Key_Z:
+      // cycle through the depth buffer formats
+      m_renderer.setDepthFormat(DepthBuffer::Format((m_renderer.depthFormat() + 1)
+        % (DepthBuffer::FORMAT_UNORM16 + 1)));
+      emit repaintNeeded();
+      break;
+    case Qt::Key_L:
+      // switch between row-major and tiled depth buffer layout
+      m_renderer.setDepthLayout(m_renderer.depthLayout() == DepthBuffer::LAYOUT_ROW_MAJOR
+        ? DepthBuffer::LAYOUT_TILED : DepthBuffer::LAYOUT_ROW_MAJOR);
+      emit repaintNeeded();
+      break;
+    case Qt::Key_C:
+      // cycle through the face culling modes
+      m_renderer.setCullMode(Model::CullMode((m_renderer.cullMode() + 1)
+        % (Model::CULL_FRONT + 1)));
+      emit repaintNeeded();
+      break;
+    case Qt::Key_O:
+      // switch hierarchical Z occlusion culling
+      m_renderer.setOcclusionCulling(!m_renderer.occlusionCulling());
+      emit repaintNeeded();
+      break;
+    case Qt::Key_F:
+      // switch front to back triangle ordering
+      m_renderer.setFrontToBack(!m_renderer.frontToBack());
+      emit repaintNeeded();
+      break;
+    case Qt::Key_T:
+      // switch between single and multiple threads
+      m_renderer.setNumThreads(m_renderer.numThreads() == 1 ? 0 : 1);
+      emit repaintNeeded();
+      break;
+    default:
+      QWidget::keyPressEvent(event);
+  }
+}
@@ -4,10 +4,12 @@
 #include <QWidget>
 #include <QPaintEvent>
 #include <QMouseEvent>
+#include <QKeyEvent>
 #include <Eigen/Eigen>
 #include "Model.hpp"
+#include "Renderer.hpp"
 
-class ZBWidget : public QWidget, EigenTypes {
+class ZBWidget : public QWidget, public EigenTypesT<double> {
 
 Q_OBJECT
 
@@ -28,6 +30,7 @@ protected:
   virtual void mouseMoveEvent(QMouseEvent *event);
   virtual void mousePressEvent(QMouseEvent *event);
   virtual void mouseReleaseEvent(QMouseEvent *event);
+  virtual void keyPressEvent(QKeyEvent *event);
 
 signals:
   void repaintNeeded();
@@ -39,6 +42,7 @@ private:
   float m_cameraAngleX;
   float m_cameraAngleY;
   float m_cameraDistance;
+  Renderer m_renderer;
 
 };
 
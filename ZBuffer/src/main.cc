@@ -1,11 +1,230 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <QApplication>
+#include <QDir>
+#include <QTemporaryFile>
 #include "MainWindow.hpp"
+#include "ZBWidget.hpp"
 #include <QGLFormat>
+#include "Logger.hpp"
+
+/** \brief Count the pixels where images a and b of n pixels differ, and
+ * raise max_diff to the largest difference of a color channel.
+ */
+static void compareImages(const uint32_t *a, const uint32_t *b, size_t n,
+                          size_t &differ, int &max_diff)
+{
+  for ( size_t j=0; j < n; j++ )
+  {
+    if ( a[j] == b[j] )
+      continue;
+    differ++;
+    for ( int s=0; s < 24; s += 8 )
+      max_diff = std::max(max_diff, abs(int((a[j]>>s)&0xff) - int((b[j]>>s)&0xff)));
+  }
+}
+
+/** \brief Write a square drawn twice in the same plane to file.
+ *
+ * The copies are split along opposite diagonals, so their depths round
+ * differently and each is nearer at some pixels and ties at others, and
+ * their normals are tilted apart, so they differ in color.
+ */
+static bool writeCoplanarScene(QTemporaryFile &file)
+{
+  static const char scene[] =
+    "o first\n"
+    "v -1 -1 0\nv 1 -1 0\nv 1 1 0\nv -1 1 0\n"
+    "vn 0 0 1\n"
+    "f 1//1 2//1 3//1\nf 1//1 3//1 4//1\n"
+    "o second\n"
+    "v -1 -1 0\nv 1 -1 0\nv 1 1 0\nv -1 1 0\n"
+    "vn 0.6 0 0.8\n"
+    "f 5//2 6//2 8//2\nf 6//2 7//2 8//2\n";
+  return file.open() && file.write(scene, sizeof(scene)-1) == qint64(sizeof(scene)-1)
+    && file.flush();
+}
+
+/** \brief Time the float pipeline against the double reference pipeline.
+ *
+ * Renders frames with the camera of the ZBuffer view turning around the
+ * model, and prints the average stage times of both precisions and how
+ * far the float image is from the double one, for each raster mode since
+ * the barycentric mode inverts a matrix in the precision of the pipeline.
+ * A further renderer sorts the triangles front to back, to count the
+ * shading calls this saves against the float one in submission order.
+ * Two more float renderers shade from a visibility buffer and after a
+ * depth pre-pass, to be timed against the direct shading of the first;
+ * all three shading modes also render a scene of coplanar overlaps, where
+ * the pixels they differ at would show triangles tying in depth resolved
+ * differently. Renderers timed against each other render a Model of their
+ * own, since the vertex cache of a shared one would spare all but the
+ * first the vertex transforms. The frames are timed on the second turn,
+ * once the frame arenas have grown to the size of the scene; with
+ * COUNT_ALLOCATIONS, that turn must not allocate from the heap.
+ */
+static int bench(const char *file, int frames)
+{
+  const int width = 1024;
+  const int height = 768;
+
+  Model model(file);
+  Model sorted_model(file);
+  Model deferred_model(file);
+  Model prepass_model(file);
+  Model *shading_model[2] = {&deferred_model, &prepass_model};
+  QTemporaryFile coplanar_file(QDir::tempPath() + "/coplanar-XXXXXX.obj");
+  if ( !writeCoplanarScene(coplanar_file) )
+  {
+    printf("Cannot write the coplanar scene to %s\n", qPrintable(coplanar_file.fileName()));
+    return 1;
+  }
+  Model coplanar(qPrintable(coplanar_file.fileName()));
+  RendererT<float> single;
+  RendererT<double> reference;
+  const TriangleBase::RasterMode raster_modes[3] = {TriangleBase::RASTER_EDGE_FUNCTION,
+    TriangleBase::RASTER_BARYCENTRIC, TriangleBase::RASTER_HIERARCHICAL};
+  RendererT<float> single_raster[2];
+  RendererT<double> reference_raster[2];
+  for ( int k=0; k < 2; k++ )
+  {
+    single_raster[k].setRasterMode(raster_modes[k+1]);
+    reference_raster[k].setRasterMode(raster_modes[k+1]);
+  }
+  RendererT<float> sorted;
+  sorted.setFrontToBack(true);
+  const RendererBase::ShadingMode modes[3] = {RendererBase::SHADING_DIRECT,
+    RendererBase::SHADING_DEFERRED, RendererBase::SHADING_DEPTH_PREPASS};
+  RendererT<float> shading[2];
+  for ( int k=0; k < 2; k++ )
+    shading[k].setShadingMode(modes[k+1]);
+  RendererT<float> coplanar_shading[3];
+  for ( int k=0; k < 3; k++ )
+    coplanar_shading[k].setShadingMode(modes[k]);
+
+  double total[2] = {0.0, 0.0};
+  double geometry[2] = {0.0, 0.0};
+  double raster[2] = {0.0, 0.0};
+  size_t differ[3] = {0, 0, 0};
+  int max_diff[3] = {0, 0, 0};
+  size_t allocations = 0;
+  double sort_ms = 0.0;
+  double sorted_total = 0.0;
+  size_t shaded = 0;
+  size_t avoided = 0;
+  double mode_total[3] = {0.0, 0.0, 0.0};
+  double mode_raster[3] = {0.0, 0.0, 0.0};
+  size_t mode_shaded[3] = {0, 0, 0};
+  size_t mode_differ[3] = {0, 0, 0};
+  size_t coplanar_covered = 0;
+  size_t coplanar_differ[3] = {0, 0, 0};
+
+  for ( int i=0; i < 2*frames; i++ )
+  {
+    const ZBWidget::Matrix4 projection
+      = ZBWidget::perspective(60.0f, (float)width/height, 1.0f, 1000.0f);
+    ZBWidget::Matrix4 modelView(ZBWidget::Matrix4::Identity());
+    modelView *= ZBWidget::lookAt(0.0f, 0.0f, 3.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+    modelView *= ZBWidget::rotateY(i * 360.0f / frames);
+
+    single.render(model, modelView.cast<float>(), projection.cast<float>(), width, height);
+    reference.render(model, modelView, projection, width, height);
+    for ( int k=0; k < 2; k++ )
+    {
+      single_raster[k].render(model, modelView.cast<float>(), projection.cast<float>(),
+                              width, height);
+      reference_raster[k].render(model, modelView, projection, width, height);
+    }
+    sorted.render(sorted_model, modelView.cast<float>(), projection.cast<float>(),
+                  width, height);
+    for ( int k=0; k < 2; k++ )
+      shading[k].render(*shading_model[k], modelView.cast<float>(), projection.cast<float>(),
+                        width, height);
+    for ( int k=0; k < 3; k++ )
+      coplanar_shading[k].render(coplanar, modelView.cast<float>(), projection.cast<float>(),
+                                 width, height);
+    if ( i < frames )
+      continue;
+
+    allocations += sorted.stats().allocations;
+    sort_ms += sorted.stats().sortMs;
+    sorted_total += sorted.stats().totalMs;
+    shaded += single.stats().shaded;
+    avoided += single.stats().shaded - std::min(single.stats().shaded, sorted.stats().shaded);
+
+    const RenderStats *stats[2] = {&single.stats(), &reference.stats()};
+    for ( int k=0; k < 2; k++ )
+    {
+      allocations += stats[k]->allocations;
+      total[k] += stats[k]->totalMs;
+      geometry[k] += stats[k]->geometryMs;
+      raster[k] += stats[k]->rasterMs;
+    }
+
+    const RendererT<float> *by_mode[3] = {&single, &shading[0], &shading[1]};
+    for ( int k=0; k < 3; k++ )
+    {
+      const RenderStats &mode_stats = by_mode[k]->stats();
+      if ( k > 0 )
+        allocations += mode_stats.allocations;
+      mode_total[k] += mode_stats.totalMs;
+      mode_raster[k] += mode_stats.rasterMs;
+      mode_shaded[k] += mode_stats.shaded;
+      for ( size_t j=0; j < size_t(width)*height; j++ )
+        mode_differ[k] += by_mode[k]->colorBuffer()[j] != single.colorBuffer()[j];
+
+      allocations += coplanar_shading[k].stats().allocations;
+      for ( size_t j=0; j < size_t(width)*height; j++ )
+        coplanar_differ[k] += coplanar_shading[k].colorBuffer()[j]
+          != coplanar_shading[0].colorBuffer()[j];
+    }
+    coplanar_covered += coplanar_shading[0].stats().covered;
+
+    compareImages(single.colorBuffer(), reference.colorBuffer(), size_t(width)*height,
+                  differ[0], max_diff[0]);
+    for ( int k=0; k < 2; k++ )
+    {
+      allocations += single_raster[k].stats().allocations;
+      allocations += reference_raster[k].stats().allocations;
+      compareImages(single_raster[k].colorBuffer(), reference_raster[k].colorBuffer(),
+                    size_t(width)*height, differ[k+1], max_diff[k+1]);
+    }
+  }
+
+  const char *names[2] = {"float", "double"};
+  for ( int k=0; k < 2; k++ )
+    printf("%-6s  total %7.2f ms  geometry %7.2f ms  raster %7.2f ms\n", names[k],
+      total[k]/frames, geometry[k]/frames, raster[k]/frames);
+  printf("front to back  total %7.2f ms  sort %7.2f ms, %lu of %lu shading calls per frame avoided (%.1f%%)\n",
+    sorted_total/frames, sort_ms/frames, avoided/frames, shaded/frames,
+    shaded ? 100.0 * avoided / shaded : 0.0);
+  for ( int k=0; k < 3; k++ )
+    printf("%-14s  total %7.2f ms  raster %7.2f ms, %lu shading calls per frame, %.4f%% pixels differ from direct, %.4f%% of coplanar overlaps\n",
+      RendererBase::shadingModeName(modes[k]), mode_total[k]/frames, mode_raster[k]/frames,
+      mode_shaded[k]/frames, 100.0 * mode_differ[k] / (double(width)*height*frames),
+      coplanar_covered ? 100.0 * coplanar_differ[k] / coplanar_covered : 0.0);
+  for ( int k=0; k < 3; k++ )
+    printf("float vs double, %s raster: %.4f%% pixels differ, max channel difference %d\n",
+      TriangleBase::rasterModeName(raster_modes[k]),
+      100.0 * differ[k] / (double(width)*height*frames), max_diff[k]);
+#ifdef COUNT_ALLOCATIONS
+  printf("heap allocations after warm-up: %lu\n", allocations);
+  ASSERT_MSG(allocations == 0, "steady state frames allocated from the heap");
+#endif
+  return 0;
+}
 
 int main(int argc, char * argv[]) {
+  if ( argc >= 3 && argc <= 4 && strcmp(argv[1], "--bench") == 0 ) {
+    const int frames = argc == 4 ? atoi(argv[3]) : 36;
+    return bench(argv[2], std::max(frames, 1));
+  }
+
   if ( argc != 2 ) {
-    printf("Usage: zbuffer obj_file\n");
+    printf("Usage: zbuffer obj_file\n"
+           "       zbuffer --bench obj_file [frames]\n");
     return 1;
   }
 